@@ -7,6 +7,7 @@
 #include "compiler/compiler.h"
 #include "compiler/scanner.h"
 #include "disassembler/lineinfo.h"
+#include "vm/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "disassembler/debug.h"
@@ -45,6 +46,14 @@ typedef struct {
   Token name;
   int depth;
   bool isCaptured;
+  // Whether it may be assigned after its declaration, so closures must
+  // capture it by reference.
+  bool reassigned;
+  int start; // Code offset of its declaration.
+  // The function a fun declaration put here, if its closure may be made in
+  // the frame, and whether the local has been read other than to call it.
+  ObjFunction* function;
+  bool escapes;
 } Local;
 
 typedef struct {
@@ -59,6 +68,15 @@ typedef enum {
   TYPE_SCRIPT
 } FunctionType;
 
+// The instructions that read a method, `a.b` or `super.b`, from just after
+// the receiver to their end.
+typedef struct {
+  int start;
+  int end;
+  uint8_t name;
+  bool isSuper;
+} PropertyGet;
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
@@ -68,6 +86,11 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastCall; // Offset of the last call instruction emitted, or -1.
+  PropertyGet lastGet;
+  int lastLabel; // Offset the last forward jump was patched to land on.
+  int frameClosuresSize; // Bytes of frame storage given to closures.
+  bool sharesUpvalues; // Whether a nested function captures an upvalue.
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -178,9 +201,55 @@ void emitReturn() {
   emitByte(OP_RETURN);
 }
 
+// A closure that was only ever called through local cannot outlive the
+// frame, so the function's closures are made in the frame from then on,
+// while it has room.
+static void placeFrameClosures(Local* local) {
+  if (local->function == NULL || local->isCaptured || local->escapes) return;
+
+  size_t size = frameClosureSize(local->function);
+  if (current->frameClosuresSize + size > FRAME_CLOSURES_MAX) return;
+  local->function->frameOffset = current->frameClosuresSize;
+  current->frameClosuresSize += (int)size;
+}
+
+// Rewrites the closures that capture local, which is never assigned again,
+// to copy its value instead of sharing an upvalue over its slot.
+static void captureByValue(Local* local) {
+  Chunk* chunk = currentChunk();
+  int slot = (int)(local - current->locals);
+  for (int offset = local->start; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] != OP_CLOSURE) continue;
+
+    ObjFunction* function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    uint8_t* captures = &chunk->code[offset + 2];
+    for (int i = 0; i < function->upvalueCount; i++) {
+      if (captures[2 * i] == CAPTURE_LOCAL && captures[2 * i + 1] == slot) {
+        captures[2 * i] = CAPTURE_VALUE;
+        function->cellCount++;
+      }
+    }
+  }
+  local->isCaptured = false;
+}
+
+// Called as local goes out of scope, once every use of it has been seen.
+static void endLocal(Local* local) {
+  placeFrameClosures(local);
+  if (local->isCaptured && !local->reassigned) captureByValue(local);
+}
+
 static ObjFunction* endCompiler() {
+  for (int i = 0; i < current->localCount; i++) {
+    endLocal(&current->locals[i]);
+  }
   emitReturn();
   ObjFunction* function = current->function;
+  if (!parser.hadError && !profileOps) {
+    fuseSuperinstructions(currentChunk());
+  }
 
 #ifdef DEBUG_PRINT_CODE
   if (debug && !parser.hadError) {
@@ -203,7 +272,9 @@ static void endScope() {
   while (current->localCount > 0 &&
     current->locals[current->localCount - 1].depth >
        current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
+    Local* local = &current->locals[current->localCount - 1];
+    endLocal(local);
+    if (local->isCaptured) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
@@ -220,8 +291,12 @@ static void and_(bool canAssign);
 static void or_(bool canAssign);
 static uint8_t argumentList();
 static int resolveUpvalue(Compiler* compiler, Token* name);
+static void markReassigned(Compiler* compiler, int upvalue);
 static bool identifiersEqual(Token* a, Token* b);
 static uint64_t identifierConstant(Token* name);
+static uint64_t globalVariable(Token* name);
+static void namedVariable(Token name, bool canAssign);
+static Token syntheticToken(const char* text);
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
@@ -245,8 +320,72 @@ static void binary(bool canAssign) {
   }
 }
 
+static void emitPropertyCache() {
+  int cache = addPropertyCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in function.");
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static int emitMethodCache() {
+  int cache = addMethodCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    error("Too many method calls in function.");
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+  return cache;
+}
+
+// Whether the code from offset on only loads constants and locals, so that
+// nothing it does can tell whether it ran before or after a property read.
+static bool onlyLoads(int offset) {
+  Chunk* chunk = currentChunk();
+  for (; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+    switch (chunk->code[offset]) {
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG:
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE:
+      case OP_GET_LOCAL:
+        break;
+      default:
+        return false;
+    }
+  }
+  return true;
+}
+
 static void call(bool canAssign) {
+  // `(a.b)(...)`: the method read just before can be invoked instead of
+  // bound to a new ObjBoundMethod. Invoking reads it after the arguments,
+  // so only when they are plain loads, and not when a jump lands after the
+  // read, as in `(a or b.c)(...)`.
+  PropertyGet get = current->lastGet;
+  bool afterGet = get.end == currentChunk()->count &&
+                  current->lastLabel != get.end;
   uint8_t argCount = argumentList();
+
+  Chunk* chunk = currentChunk();
+  uint8_t loads[UINT8_COUNT * 4];
+  int length = chunk->count - get.end;
+  if (afterGet && length <= (int)sizeof(loads) && onlyLoads(get.end)) {
+    memcpy(loads, chunk->code + get.end, length);
+    truncateChunk(chunk, get.start);
+    for (int i = 0; i < length; i++) emitByte(loads[i]);
+    if (get.isSuper) namedVariable(syntheticToken("super"), false);
+    current->lastCall = currentChunk()->count;
+    emitBytes(get.isSuper ? OP_SUPER_INVOKE : OP_INVOKE, get.name);
+    emitByte(argCount);
+    int cache = emitMethodCache();
+    currentChunk()->methodCaches[cache].readsProperty = true;
+    return;
+  }
+
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -257,12 +396,20 @@ static void dot(bool canAssign) {
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     emitBytes(OP_SET_PROPERTY, name);
+    emitPropertyCache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitMethodCache();
   } else {
+    current->lastGet.start = currentChunk()->count;
     emitBytes(OP_GET_PROPERTY, name);
+    emitPropertyCache();
+    current->lastGet.end = currentChunk()->count;
+    current->lastGet.name = name;
+    current->lastGet.isSuper = false;
   }
 }
 
@@ -288,7 +435,7 @@ uint64_t makeConstant(Value value) {
 void emitConstant(Value value) {
   uint64_t constant = makeConstant(value);
   if (constant > UINT8_MAX) {
-    emitBytes(OP_CONSTANT, constant >> 16);
+    emitBytes(OP_CONSTANT_LONG, constant >> 16);
     emitBytes(constant >> 8, constant);
   }
   else {
@@ -306,6 +453,7 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  current->lastLabel = currentChunk()->count;
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
@@ -314,6 +462,11 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->lastGet.end = -1;
+  compiler->lastLabel = -1;
+  compiler->frameClosuresSize = 0;
+  compiler->sharesUpvalues = false;
   compiler->function = newFunction();
   current = compiler;
   if (type != TYPE_SCRIPT) {
@@ -324,6 +477,10 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   Local* local = &current->locals[current->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->reassigned = false;
+  local->start = currentChunk()->count;
+  local->function = NULL;
+  local->escapes = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -354,15 +511,23 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = globalVariable(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
     op = setOp;
+    if (op == OP_SET_LOCAL) {
+      current->locals[arg].reassigned = true;
+    } else if (op == OP_SET_UPVALUE) {
+      markReassigned(current, (int)arg);
+    }
   } else {
     op = getOp;
+    if (op == OP_GET_LOCAL && !check(TOKEN_LEFT_PAREN)) {
+      current->locals[arg].escapes = true;
+    }
   }
   if (arg > UINT8_MAX) {
     emitWord(op + 1, arg >> 16, arg >> 8, arg);
@@ -398,11 +563,18 @@ static void super_(bool canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_SUPER_INVOKE, name);
     emitByte(argCount);
+    emitMethodCache();
   } else {
+    current->lastGet.start = currentChunk()->count;
     namedVariable(syntheticToken("super"), false);
     emitBytes(OP_GET_SUPER, name);
+    emitMethodCache();
+    current->lastGet.end = currentChunk()->count;
+    current->lastGet.name = name;
+    current->lastGet.isSuper = true;
   }
 }
 
@@ -499,6 +671,10 @@ static uint64_t identifierConstant(Token* name) {
                                          name->length)));
 }
 
+static uint64_t globalVariable(Token* name) {
+  return (uint64_t)globalSlot(copyString(name->start, name->length));
+}
+
 static int resolveLocal(Compiler* compiler, Token* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
@@ -544,12 +720,23 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
+    compiler->enclosing->sharesUpvalues = true;
     return addUpvalue(compiler, (uint8_t)upvalue, false);
   }
 
   return -1;
 }
 
+// Marks the local that upvalue of compiler's function ends up capturing.
+static void markReassigned(Compiler* compiler, int upvalue) {
+  Upvalue* captured = &compiler->upvalues[upvalue];
+  if (captured->isLocal) {
+    compiler->enclosing->locals[captured->index].reassigned = true;
+  } else {
+    markReassigned(compiler->enclosing, captured->index);
+  }
+}
+
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
@@ -565,6 +752,10 @@ static void addLocal(Token name) {
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->reassigned = false;
+  local->start = currentChunk()->count;
+  local->function = NULL;
+  local->escapes = false;
 }
 
 static void declareVariable() {
@@ -589,7 +780,7 @@ static uint64_t parseVariable(const char* errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
   if (current->scopeDepth > 0) return 0;
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -664,7 +855,9 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+// Returns the function, unless its closures must go on the heap however
+// they are used.
+static ObjFunction* function(FunctionType type) {
   Compiler compiler;
   initCompiler(&compiler, type);
   beginScope();
@@ -688,9 +881,15 @@ static void function(FunctionType type) {
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    if (compiler.upvalues[i].isLocal) {
+      emitByte(CAPTURE_LOCAL);
+    } else {
+      emitByte(CAPTURE_UPVALUE);
+      function->cellCount++;
+    }
     emitByte(compiler.upvalues[i].index);
   }
+  return compiler.sharesUpvalues ? NULL : function;
 }
 
 static void method() {
@@ -709,10 +908,11 @@ static void classDeclaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token className = parser.previous;
   uint8_t nameConstant = identifierConstant(&parser.previous);
+  uint64_t global = current->scopeDepth > 0 ? 0 : globalVariable(&className);
   declareVariable();
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(global);
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -751,9 +951,16 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
+  uint64_t global = parseVariable("Expect function name.");
   markInitialized();
-  function(TYPE_FUNCTION);
+  ObjFunction* declared = function(TYPE_FUNCTION);
+  if (current->scopeDepth > 0) {
+    Local* local = &current->locals[current->localCount - 1];
+    local->function = declared;
+    // A function that refers to itself captures the slot before its
+    // closure is stored there.
+    if (local->isCaptured) local->reassigned = true;
+  }
   defineVariable(global);
 }
 
@@ -846,6 +1053,24 @@ static void printStatement() {
   emitByte(OP_PRINT);
 }
 
+// Turns the call just emitted, if the return value is its result, into the
+// tail call form. The OP_RETURN after it stays: a jump may land on it, and
+// calls that push no frame fall through to it.
+static void markTailCall() {
+  Chunk* chunk = currentChunk();
+  int call = current->lastCall;
+  if (call < 0 || call + instructionLength(chunk, call) != chunk->count) {
+    return;
+  }
+
+  switch (chunk->code[call]) {
+    case OP_CALL: chunk->code[call] = OP_TAIL_CALL; break;
+    case OP_INVOKE: chunk->code[call] = OP_TAIL_INVOKE; break;
+    case OP_SUPER_INVOKE: chunk->code[call] = OP_TAIL_SUPER_INVOKE; break;
+    default: break;
+  }
+}
+
 static void returnStatement() {
   if (current->type == TYPE_SCRIPT) {
     error("Can't return from top-level code.");
@@ -860,6 +1085,7 @@ static void returnStatement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    markTailCall();
     emitByte(OP_RETURN);
   }
 }
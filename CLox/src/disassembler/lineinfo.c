@@ -12,28 +12,28 @@ LineInfo getLineInfo(Chunk *chunk, int offset)
 {
     LineInfoArray lineinfos = chunk->lineinfos;
     int arraySize = lineinfos.count;
-    int mid = arraySize / 2;
+    int found = 0;
     int low = 0;
     int high = arraySize - 1;
 
+    // Each entry starts a run of bytes with the same position, so an offset
+    // inside a run, such as an operand's, belongs to the last entry at or
+    // before it.
     while (low <= high)
     {
-        mid = low + (high - low) / 2;
-        if (offset < lineinfos.lineinfos[mid].offset)
-        {
-            high = mid - 1;
-        }
-        else if (offset > lineinfos.lineinfos[mid].offset)
+        int mid = low + (high - low) / 2;
+        if (lineinfos.lineinfos[mid].offset <= offset)
         {
+            found = mid;
             low = mid + 1;
         }
         else
         {
-            break;
+            high = mid - 1;
         }
     }
 
-    return lineinfos.lineinfos[mid];
+    return lineinfos.lineinfos[found];
 }
 
 bool isSameLineInfo(LineInfo a, LineInfo b){
@@ -0,0 +1,124 @@
+#include <stdio.h>
+
+#include "disassembler/profile.h"
+
+// Counts how often each instruction is followed by another, and by two
+// others, in the bytecode the VM executes. tools/gen_superinstructions.py
+// turns the counts into superinstructions.h. Only instructions the VM can
+// fuse are recorded: the ones that never transfer control may start or
+// continue a sequence, and the rest may only end one.
+typedef struct
+{
+  OpCode op;
+  const char *name;
+} FusableOp;
+
+static const FusableOp fusableOps[] = {
+    {OP_CONSTANT, "OP_CONSTANT"},
+    {OP_NIL, "OP_NIL"},
+    {OP_TRUE, "OP_TRUE"},
+    {OP_FALSE, "OP_FALSE"},
+    {OP_POP, "OP_POP"},
+    {OP_GET_LOCAL, "OP_GET_LOCAL"},
+    {OP_SET_LOCAL, "OP_SET_LOCAL"},
+    {OP_GET_GLOBAL, "OP_GET_GLOBAL"},
+    {OP_SET_GLOBAL, "OP_SET_GLOBAL"},
+    {OP_GET_UPVALUE, "OP_GET_UPVALUE"},
+    {OP_SET_UPVALUE, "OP_SET_UPVALUE"},
+    {OP_GET_PROPERTY, "OP_GET_PROPERTY"},
+    {OP_SET_PROPERTY, "OP_SET_PROPERTY"},
+    {OP_EQUAL, "OP_EQUAL"},
+    {OP_GREATER, "OP_GREATER"},
+    {OP_LESS, "OP_LESS"},
+    {OP_ADD, "OP_ADD"},
+    {OP_SUBTRACT, "OP_SUBTRACT"},
+    {OP_MULTIPLY, "OP_MULTIPLY"},
+    {OP_DIVIDE, "OP_DIVIDE"},
+    {OP_NOT, "OP_NOT"},
+    {OP_NEGATE, "OP_NEGATE"},
+    // Control transfers: last position only.
+    {OP_JUMP_IF_FALSE, "OP_JUMP_IF_FALSE"},
+    {OP_JUMP, "OP_JUMP"},
+    {OP_LOOP, "OP_LOOP"},
+    {OP_CALL, "OP_CALL"},
+    {OP_INVOKE, "OP_INVOKE"},
+    {OP_RETURN, "OP_RETURN"},
+};
+
+#define FUSABLE_COUNT (int)(sizeof(fusableOps) / sizeof(fusableOps[0]))
+#define LEADING_COUNT 22
+
+static uint64_t executed;
+static uint64_t pairCounts[LEADING_COUNT][FUSABLE_COUNT];
+static uint64_t tripleCounts[LEADING_COUNT][LEADING_COUNT][FUSABLE_COUNT];
+
+static int fusableIndex(uint8_t op)
+{
+  for (int i = 0; i < FUSABLE_COUNT; i++)
+  {
+    if (fusableOps[i].op == op)
+      return i;
+  }
+  return -1;
+}
+
+// Returns the fusable index of the instruction after the one at offset.
+static int nextFusable(Chunk *chunk, int *offset)
+{
+  *offset += instructionLength(chunk, *offset);
+  if (*offset >= chunk->count)
+    return -1;
+  return fusableIndex(chunk->code[*offset]);
+}
+
+void profileInstruction(Chunk *chunk, int offset)
+{
+  executed++;
+
+  int first = fusableIndex(chunk->code[offset]);
+  if (first < 0 || first >= LEADING_COUNT)
+    return;
+
+  int second = nextFusable(chunk, &offset);
+  if (second < 0)
+    return;
+  pairCounts[first][second]++;
+  if (second >= LEADING_COUNT)
+    return;
+
+  int third = nextFusable(chunk, &offset);
+  if (third < 0)
+    return;
+  tripleCounts[first][second][third]++;
+}
+
+void printOpcodeProfile()
+{
+  fprintf(stderr, "executed %lu\n", executed);
+  for (int a = 0; a < LEADING_COUNT; a++)
+  {
+    for (int b = 0; b < FUSABLE_COUNT; b++)
+    {
+      if (pairCounts[a][b] != 0)
+      {
+        fprintf(stderr, "pair %lu %s %s\n", pairCounts[a][b],
+                fusableOps[a].name, fusableOps[b].name);
+      }
+    }
+  }
+
+  for (int a = 0; a < LEADING_COUNT; a++)
+  {
+    for (int b = 0; b < LEADING_COUNT; b++)
+    {
+      for (int c = 0; c < FUSABLE_COUNT; c++)
+      {
+        if (tripleCounts[a][b][c] != 0)
+        {
+          fprintf(stderr, "triple %lu %s %s %s\n", tripleCounts[a][b][c],
+                  fusableOps[a].name, fusableOps[b].name, fusableOps[c].name);
+        }
+      }
+    }
+  }
+}
@@ -46,28 +46,107 @@ typedef enum
     OP_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    // Calls in tail position: the callee's frame replaces the caller's.
+    OP_TAIL_CALL,
+    OP_TAIL_INVOKE,
+    OP_TAIL_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
     OP_METHOD,
+    // Type-specialized forms the VM rewrites generic instructions into once
+    // they have seen number operands. The compiler never emits these.
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    // Superinstructions chosen from an opcode profile; see
+    // superinstructions.h. fuseSuperinstructions() rewrites only the first
+    // opcode byte of a matched sequence, so the components stay in place.
+#define SUPERINSTRUCTION2(name, a, b) name,
+#define SUPERINSTRUCTION3(name, a, b, c) name,
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
 } OpCode;
 
+// How OP_CLOSURE captures each upvalue: the byte before the index.
+typedef enum
+{
+    CAPTURE_UPVALUE, // One of the enclosing closure's upvalues.
+    CAPTURE_LOCAL,   // A local of the enclosing frame, by reference.
+    CAPTURE_VALUE,   // A local never assigned again, copied into the closure.
+} CaptureKind;
+
+#define PROPERTY_CACHE_WAYS 4
+
+struct ObjShape;
+struct Trace;
+
+typedef struct PropertyCacheEntry
+{
+    struct ObjShape *shape;
+    // Set only for OP_SET_PROPERTY sites that add a new field: the shape
+    // the instance moves to once the value is stored in `slot`.
+    struct ObjShape *transition;
+    int slot;
+} PropertyCacheEntry;
+
+// Inline cache for a single OP_GET_PROPERTY/OP_SET_PROPERTY site. Unused
+// entries have a NULL shape; misses fill the ways round-robin.
+typedef struct PropertyCache
+{
+    PropertyCacheEntry entries[PROPERTY_CACHE_WAYS];
+    int next;
+} PropertyCache;
+
+// Monomorphic cache for an OP_INVOKE, OP_SUPER_INVOKE or OP_GET_SUPER site.
+// `key` is the receiver's shape for OP_INVOKE (a shape pins both the class
+// and the absence of a shadowing field) and the superclass for the super
+// instructions. Entries are only valid while `epoch` matches
+// vm.methodEpoch, which OP_METHOD and OP_INHERIT bump.
+typedef struct MethodCache
+{
+    Obj *key;
+    struct ObjClosure *method;
+    uint32_t epoch;
+    // Set for `(obj.name)(...)`, whose errors are those of reading the
+    // property.
+    bool readsProperty;
+} MethodCache;
+
 typedef struct Chunk
 {
     int count;
     int capacity;
     uint8_t *code;
+    uint8_t *original; // Copy of code taken before the first quickening.
     LineInfoArray lineinfos;
     ValueArray constants;
+    int propertyCacheCount;
+    int propertyCacheCapacity;
+    PropertyCache *propertyCaches;
+    int methodCacheCount;
+    int methodCacheCapacity;
+    MethodCache *methodCaches;
+    struct Trace *traces; // Loops seen by the tracing JIT; see vm/trace.h.
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, LineInfo line);
 void writeConstant(Chunk *chunk, Value value, LineInfo line);
+void truncateChunk(Chunk *chunk, int count);
 void freeChunk(Chunk *chunk);
 int addConstant(Chunk *chunk, Value value);
+int addPropertyCache(Chunk *chunk);
+int addMethodCache(Chunk *chunk);
+int instructionLength(Chunk *chunk, int offset);
+uint8_t baseOpcode(Chunk *chunk, int offset);
+void fuseSuperinstructions(Chunk *chunk);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,16 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "chunk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void profileInstruction(Chunk *chunk, int offset);
+void printOpcodeProfile();
+
+#ifdef __cplusplus
+}
+#endif
+#endif
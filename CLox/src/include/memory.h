@@ -24,11 +24,72 @@ extern "C" {
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Whether the collector is generational; set by --generational.
+extern bool generationalGC;
+// Whether collections mark in steps between allocations, and the objects
+// each step traces; set by --incremental and --gc-step.
+extern bool incrementalGC;
+extern int gcStepBudget;
+// Whether collections mark on a thread of their own; set by --concurrent.
+extern bool concurrentGC;
+// Threads the stop-the-world collector marks and sweeps with; set by
+// --gc-threads.
+extern int gcThreads;
+// Whether the stop-the-world collector leaves sweeping to the allocations
+// that follow it; set by --lazy-sweep.
+extern bool lazySweep;
+// Whether an incremental collection is marking, and whether the marking
+// thread is.
+extern bool gcMarking;
+extern bool gcConcurrentMarking;
+
+// The marking thread reads the fields written with PUBLISH while the
+// mutator changes them. Reading one with OBSERVE, it sees every write the
+// mutator made before it.
+#if defined(__GNUC__)
+#define PUBLISH(field, value) \
+    __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define OBSERVE(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#else
+#define PUBLISH(field, value) ((field) = (value))
+#define OBSERVE(field) (field)
+#endif
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void rememberObject(Obj* object);
+void logObject(Obj* object);
+void trackRegion(Obj* object);
 void markObject(Obj* object);
 void markValue(Value value);
+
+// Called after value is stored into owner. An old object that comes to
+// refer to a young one is remembered, so minor collections can find the
+// young object without tracing the old generation. While an incremental
+// collection is marking, an object stored into one already marked is
+// marked too, since the collector may have traced the owner already.
+static inline void writeBarrier(Obj* owner, Value value) {
+  if (!IS_OBJ(value)) return;
+  Obj* object = AS_OBJ(value);
+  if (owner->isOld) {
+    if (!owner->isRemembered && !object->isOld) rememberObject(owner);
+  } else if (gcMarking && owner->isMarked && !object->isMarked) {
+    markObject(object);
+  }
+}
+
+// Called with a value about to be overwritten, or found again in
+// vm.strings, while the marking thread runs. It is logged unless marked,
+// so everything reachable when marking began is marked by the end, though
+// the marking thread may no longer find the way to it.
+static inline void snapshotBarrier(Value value) {
+  if (gcConcurrentMarking && IS_OBJ(value) && !AS_OBJ(value)->isMarked) {
+    logObject(AS_OBJ(value));
+  }
+}
+
 void collectGarbage();
 void freeObjects();
+void printGcStats();
 
 #ifdef __cplusplus
 }
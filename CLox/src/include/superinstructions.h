@@ -0,0 +1,30 @@
+// Generated by tools/gen_superinstructions.py from an opcode profile
+// of 269 scripts. Do not edit; rerun the script instead.
+//
+// SUPERINSTRUCTION2(name, first, second)
+// SUPERINSTRUCTION3(name, first, second, third)
+
+SUPERINSTRUCTION2(OP_POP_GET_GLOBAL, OP_POP, OP_GET_GLOBAL) // 10331230
+SUPERINSTRUCTION3(OP_GET_LOCAL_GET_PROPERTY_RETURN, OP_GET_LOCAL, OP_GET_PROPERTY, OP_RETURN) // 9151241
+SUPERINSTRUCTION2(OP_GET_LOCAL_GET_PROPERTY, OP_GET_LOCAL, OP_GET_PROPERTY) // 7783725
+SUPERINSTRUCTION3(OP_POP_GET_GLOBAL_INVOKE, OP_POP, OP_GET_GLOBAL, OP_INVOKE) // 7598789
+SUPERINSTRUCTION2(OP_GET_GLOBAL_INVOKE, OP_GET_GLOBAL, OP_INVOKE) // 6327127
+SUPERINSTRUCTION3(OP_POP_GET_GLOBAL_POP, OP_POP, OP_GET_GLOBAL, OP_POP) // 4978606
+SUPERINSTRUCTION3(OP_GET_GLOBAL_POP_GET_GLOBAL, OP_GET_GLOBAL, OP_POP, OP_GET_GLOBAL) // 4974743
+SUPERINSTRUCTION2(OP_GET_PROPERTY_RETURN, OP_GET_PROPERTY, OP_RETURN) // 4575620
+SUPERINSTRUCTION3(OP_ADD_GET_GLOBAL_INVOKE, OP_ADD, OP_GET_GLOBAL, OP_INVOKE) // 4145218
+SUPERINSTRUCTION3(OP_POP_GET_GLOBAL_CALL, OP_POP, OP_GET_GLOBAL, OP_CALL) // 3726796
+SUPERINSTRUCTION3(OP_CONSTANT_LESS_JUMP_IF_FALSE, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE) // 3086984
+SUPERINSTRUCTION2(OP_GET_LOCAL_RETURN, OP_GET_LOCAL, OP_RETURN) // 2983999
+SUPERINSTRUCTION3(OP_POP_GET_GLOBAL_GET_GLOBAL, OP_POP, OP_GET_GLOBAL, OP_GET_GLOBAL) // 2933759
+SUPERINSTRUCTION2(OP_POP_GET_LOCAL, OP_POP, OP_GET_LOCAL) // 2679772
+SUPERINSTRUCTION2(OP_GET_LOCAL_CONSTANT, OP_GET_LOCAL, OP_CONSTANT) // 2619790
+SUPERINSTRUCTION3(OP_SET_PROPERTY_POP_GET_LOCAL, OP_SET_PROPERTY, OP_POP, OP_GET_LOCAL) // 2533191
+SUPERINSTRUCTION2(OP_GET_GLOBAL_POP, OP_GET_GLOBAL, OP_POP) // 2489326
+SUPERINSTRUCTION3(OP_GET_GLOBAL_GET_GLOBAL_EQUAL, OP_GET_GLOBAL, OP_GET_GLOBAL, OP_EQUAL) // 2489317
+SUPERINSTRUCTION3(OP_GET_GLOBAL_EQUAL_POP, OP_GET_GLOBAL, OP_EQUAL, OP_POP) // 2489303
+SUPERINSTRUCTION3(OP_EQUAL_POP_GET_GLOBAL, OP_EQUAL, OP_POP, OP_GET_GLOBAL) // 2485413
+SUPERINSTRUCTION2(OP_POP_CONSTANT, OP_POP, OP_CONSTANT) // 2369769
+SUPERINSTRUCTION2(OP_EQUAL_POP, OP_EQUAL, OP_POP) // 2336605
+SUPERINSTRUCTION3(OP_POP_CONSTANT_POP, OP_POP, OP_CONSTANT, OP_POP) // 2298850
+SUPERINSTRUCTION3(OP_GET_LOCAL_CONSTANT_SUBTRACT, OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT) // 2124400
@@ -0,0 +1,67 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "vm/object.h"
+#include "vm/vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Calls a function needs before the baseline JIT compiles it under --jit.
+#define JIT_HOT_CALLS 1000
+
+// Native code for one function. It shares CallFrame and the value stack
+// with the interpreter and can be entered at the start of any instruction.
+typedef struct JitCode
+{
+    uint8_t *code;
+    size_t size;
+    void **entries; // Native address of each instruction, by bytecode offset.
+} JitCode;
+
+// Runs one instruction out of line. Defined in vm.c, where the instruction
+// bodies live. NULL entries mark opcodes the JIT leaves to the interpreter.
+typedef InterpretResult (*JitHelper)(CallFrame *frame);
+extern const JitHelper jitHelpers[UINT8_COUNT];
+bool jitPeekFalsey();
+
+struct Trace;
+
+// Calls before a function is compiled, or -1 to never compile.
+extern int jitThreshold;
+
+// Compiles function, or marks it as interpreter-only if it uses an opcode
+// the JIT does not handle. Returns whether native code is now available.
+bool jitCompile(ObjFunction *function);
+void jitFree(JitCode *jit);
+// Whether op can be compiled, inline or through its helper.
+bool jitSupports(uint8_t op);
+
+// Runs frame natively from entry, following calls and returns into other
+// compiled functions, until the top frame is interpreted, the program ends
+// or a runtime error occurs.
+InterpretResult jitRun(CallFrame *frame, void *entry);
+
+// Compiles a recorded trace into one straight-line loop with guards. A
+// failing guard saves ip in the current frame and returns, leaving the VM as
+// the interpreter would have at that instruction.
+bool jitCompileTrace(struct Trace *trace);
+void jitFreeTrace(struct Trace *trace);
+InterpretResult jitRunTrace(struct Trace *trace, CallFrame *frame);
+
+// Returns where frame would resume in native code, or NULL if its function
+// has not been compiled.
+static inline void *jitEntry(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    if (function->jit == NULL)
+        return NULL;
+    return function->jit->entries[frame->ip - function->chunk.code];
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -18,6 +18,7 @@ extern "C" {
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_SHAPE(value) isObjType(value, OBJ_SHAPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
@@ -25,8 +26,8 @@ extern "C" {
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
-#define AS_NATIVE(value) \
-    (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
@@ -40,12 +41,21 @@ typedef enum
     OBJ_NATIVE,
     OBJ_CLOSURE,
     OBJ_UPVALUE,
+    OBJ_SHAPE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_SHAPE + 1)
+
 struct Obj
 {
     ObjType type;
     bool isMarked;
+    // Under --generational: whether the object is old, whether it is in
+    // vm.remembered, and the minor collections it has survived while young.
+    // See writeBarrier() in memory.h.
+    bool isOld;
+    bool isRemembered;
+    uint8_t age;
     struct Obj *next;
 };
 
@@ -53,10 +63,30 @@ struct ObjString
 {
     Obj obj;
     int length;
-    char *chars;
-    uint32_t hash;
+    bool interned;    // Otherwise the string is an ObjLazyString.
+    uint32_t hash;    // Computed when the string is interned.
+    char chars[];     // Only in interned strings; see stringChars().
 };
 
+// Concatenations at least this long build a rope instead of copying.
+#define ROPE_MIN_LENGTH 64
+
+// A string made at runtime. It is neither hashed nor interned until it is
+// compared: until then it holds its characters or, as a rope, the two halves
+// of a long concatenation. Once interned it stands for the interned string
+// with its characters. It starts like ObjString, with interned false.
+typedef struct
+{
+    Obj obj;
+    int length;
+    bool interned;
+    uint32_t hash;
+    char *chars;          // NULL in a rope, or once interned.
+    ObjString *canonical; // The interned string, once found.
+    ObjString *left;      // A rope's halves, until it is flattened.
+    ObjString *right;
+} ObjLazyString;
+
 typedef struct ObjUpvalue
 {
     Obj obj;
@@ -72,36 +102,77 @@ typedef struct
     int upvalueCount;
     Chunk chunk;
     ObjString *name;
+    int callCount; // -1 once the JIT has declined the function.
+    // Where its closures are made in the frame that makes them, or -1 if
+    // they go on the heap; see newFrameClosure() in vm.c.
+    int frameOffset;
+    // Upvalues its heap closures may hold themselves; see captureUpvalues()
+    // in vm.c.
+    int cellCount;
+    struct JitCode *jit;
+    struct RegCode *regcode; // Translated on first call under --register.
 } ObjFunction;
 
-typedef struct
+typedef struct ObjClosure
 {
     Obj obj;
     ObjFunction *function;
-    ObjUpvalue **upvalues;
     int upvalueCount;
+    int cellCount;
+    // Followed by cellCount upvalues the closure holds itself.
+    ObjUpvalue *upvalues[];
 } ObjClosure;
 
+// Instances above this many fields leave the shape tree and keep their
+// fields in a hash table instead.
+#define SHAPE_MAX_SLOTS 64
+
+// A hidden class: the ordered set of field names an instance has. Instances
+// of one class that add the same fields in the same order share a shape, so
+// a field's slot index can be cached per shape.
+typedef struct ObjShape
+{
+    Obj obj;
+    struct ObjShape *parent;
+    ObjString *name;  // Field added on top of parent, NULL for the root.
+    int slotCount;
+    Table slots;      // Field name -> slot index, including inherited ones.
+    Table transitions; // Field name -> child shape.
+} ObjShape;
+
 typedef struct
 {
     Obj obj;
     ObjString *name;
     Table methods;
+    ObjClosure *initializer; // methods' "init", or NULL; kept in step with it.
+    ObjShape *rootShape;
+    int slotHint;     // Most fields an instance has been seen to have.
 } ObjClass;
 
 typedef struct
 {
     Obj obj;
     ObjClass *klass;
-    Table fields;
+    ObjShape *shape; // NULL once the instance is in dictionary mode.
+    Value *slots;
+    int slotCapacity;
+    Table fields;    // Only used in dictionary mode.
 } ObjInstance;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+struct NativeContext;
+
+// A native gets its arguments in args, stores its return value in *result
+// and returns true. To fail, it returns nativeError(), and the VM reports a
+// runtime error at the call. See vm/vm.h for what context offers.
+typedef bool (*NativeFn)(struct NativeContext *context, int argCount,
+                         Value *args, Value *result);
 
 typedef struct
 {
     Obj obj;
     NativeFn function;
+    int arity;  // Checked by the VM before each call, or -1 for any count.
 } ObjNative;
 
 typedef struct
@@ -117,9 +188,20 @@ ObjClass *newClass(ObjString *name);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
 ObjClosure *newClosure(ObjFunction *function);
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(NativeFn function, int arity);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+int shapeSlot(ObjShape *shape, ObjString *name);
+void instanceAppendSlot(ObjInstance *instance, ObjShape *shape, Value value);
+bool instanceGetField(ObjInstance *instance, ObjString *name, Value *value);
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString *newString(char *chars, int length);
+ObjString *newRope(ObjString *left, ObjString *right);
+const char *flattenString(ObjLazyString *string);
+ObjString *internLazyString(ObjLazyString *string);
+bool stringsEqual(ObjString *a, ObjString *b);
 ObjUpvalue *newUpvalue(Value *slot);
 void printObject(Value value);
 
@@ -128,6 +210,46 @@ static inline bool isObjType(Value value, ObjType type)
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline size_t closureSize(int upvalueCount, int cellCount)
+{
+    return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * upvalueCount +
+           sizeof(ObjUpvalue) * cellCount;
+}
+
+// Bytes a closure of function takes when made in a frame, with room for an
+// upvalue for each variable it captures.
+static inline size_t frameClosureSize(ObjFunction *function)
+{
+    return closureSize(function->upvalueCount, function->upvalueCount);
+}
+
+static inline ObjUpvalue *closureCells(ObjClosure *closure)
+{
+    return (ObjUpvalue *)(closure->upvalues + closure->upvalueCount);
+}
+
+// Whether upvalue is one closure holds itself. Such upvalues are born
+// marked and live as long as the closure does.
+static inline bool isClosureCell(ObjClosure *closure, ObjUpvalue *upvalue)
+{
+    ObjUpvalue *cells = closureCells(closure);
+    return upvalue >= cells && upvalue < cells + closure->cellCount;
+}
+
+// string's characters, flattening it first if it is a rope.
+static inline const char *stringChars(ObjString *string)
+{
+    return string->interned ? string->chars
+                            : flattenString((ObjLazyString *)string);
+}
+
+// The interned string with string's characters.
+static inline ObjString *internString(ObjString *string)
+{
+    return string->interned ? string
+                            : internLazyString((ObjLazyString *)string);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,97 @@
+#ifndef clox_regcode_h
+#define clox_regcode_h
+
+#include "common.h"
+#include "value.h"
+#include "vm/object.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Register operands name a frame slot. With REG_CONSTANT set, the rest of
+// the operand indexes the function's register constants instead.
+#define REG_CONSTANT 0x8000
+
+typedef enum
+{
+    REG_MOVE,           // a = RK(b)
+    REG_LOAD_CONSTANT,  // a = constants[b | c << 16]
+    REG_GET_GLOBAL,     // a = globals[b | c << 16]
+    REG_DEFINE_GLOBAL,  // globals[b | c << 16] = RK(a)
+    REG_SET_GLOBAL,     // globals[b | c << 16] = RK(a), if defined
+    REG_GET_UPVALUE,    // a = upvalues[b]
+    REG_SET_UPVALUE,    // upvalues[b] = RK(a)
+    REG_GET_PROPERTY,   // a = RK(b).name[n], property cache c
+    REG_SET_PROPERTY,   // RK(a).name[n] = RK(b), property cache c
+    REG_GET_SUPER,      // a = a's method name[n] in class a + 1, cache b
+    REG_EQUAL,          // a = RK(b) op RK(c), for the binary operators
+    REG_GREATER,
+    REG_LESS,
+    REG_ADD,
+    REG_SUBTRACT,
+    REG_MULTIPLY,
+    REG_DIVIDE,
+    REG_NOT,            // a = op RK(b)
+    REG_NEGATE,
+    REG_PRINT,          // print RK(a)
+    REG_JUMP,           // goto b | c << 16
+    REG_JUMP_IF_FALSE,  // if RK(a) is falsey, goto b | c << 16
+    // Compare and branch: unless RK(a) op RK(b), goto c.
+    REG_JUMP_UNLESS_EQUAL,
+    REG_JUMP_UNLESS_GREATER,
+    REG_JUMP_UNLESS_LESS,
+    REG_CALL,           // Call a with n arguments in a + 1 onwards.
+    REG_INVOKE,         // Invoke name[c] on a with n arguments, cache b.
+    REG_SUPER_INVOKE,   // Likewise, in the class at a + n + 1.
+    REG_TAIL_CALL,      // The calls above, in tail position: the callee's
+    REG_TAIL_INVOKE,    // frame replaces this one.
+    REG_TAIL_SUPER_INVOKE,
+    REG_CLOSURE,        // a = closure of function[n]; see below.
+    REG_CLOSE_UPVALUE,  // Close the upvalue over slot a.
+    REG_RETURN,         // Return RK(a).
+    REG_CLASS,          // a = class name[n]
+    REG_INHERIT,        // Copy RK(a)'s methods into class RK(b).
+    REG_METHOD,         // Define RK(b) as method name[n] of class RK(a).
+} RegOpCode;
+
+// A three-address instruction. Operands that do not fit in 16 bits take
+// b and c together. REG_CLOSURE reads its upvalue operands from the stack
+// bytecode at offset b | c << 16.
+typedef struct
+{
+    uint8_t op;
+    uint8_t n;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} RegInstruction;
+
+// Register code for one function, translated from its stack bytecode. A
+// register is a frame slot: locals keep the slots the compiler gave them,
+// and the value the stack VM would hold at depth d lives in slot d.
+typedef struct RegCode
+{
+    RegInstruction *code;
+    int count;
+    int *offsets;       // Bytecode offset of each instruction, for errors.
+    // The chunk's constants, followed by nil, true and false.
+    Value *constants;
+    int constantCount;
+    int frameSize;      // Slots the frame uses, counting the callee's.
+} RegCode;
+
+// Whether functions run as register code instead of stack bytecode.
+extern bool registerVM;
+
+// Returns function's register code, translating it on first use.
+RegCode *regcodeFor(ObjFunction *function);
+void freeRegCode(RegCode *code);
+// Bytecode offset of the instruction before ip in a frame running register
+// code, where the stack VM's ip would point past its opcode.
+int regcodeOffset(ObjFunction *function, uint8_t *ip);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
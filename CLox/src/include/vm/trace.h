@@ -0,0 +1,86 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "vm/object.h"
+#include "vm/vm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Back-edges a loop takes under --trace before its next iteration is
+// recorded.
+#define TRACE_HOT_LOOPS 50
+// Longest trace recorded, in instructions.
+#define TRACE_MAX_STEPS 1000
+// Failed recordings before a loop is left to the interpreter for good.
+#define TRACE_MAX_ABORTS 4
+// Entries after which a trace that has not averaged one full iteration per
+// entry is thrown away.
+#define TRACE_MIN_ENTRIES 64
+
+// One executed instruction and what was observed about its operands.
+typedef struct
+{
+    ObjFunction *function;
+    int offset;
+    uint8_t op;         // As returned by baseOpcode().
+    // OP_JUMP_IF_FALSE: the jump was taken. Arithmetic and comparisons:
+    // both operands were numbers.
+    bool taken;
+    // OP_GET_PROPERTY/OP_SET_PROPERTY on a field the receiver already had:
+    // the receiver's shape and the field's slot. NULL when there is nothing
+    // to specialize on.
+    ObjShape *shape;
+    int slot;
+} TraceStep;
+
+// A loop header in one function, its back-edge counter and, once recorded
+// and compiled, the native code for one iteration of the loop's hot path.
+// Calls made by the loop body are recorded into the same trace.
+typedef struct Trace
+{
+    struct Trace *next;
+    int header;         // Bytecode offset the loop's OP_LOOP jumps back to.
+    int hits;           // Back-edges counted, or -1 once blacklisted.
+    int aborts;
+    TraceStep *steps;
+    int stepCount;
+    // The distinct functions and shapes in steps, which the GC must keep.
+    Obj **refs;
+    int refCount;
+    uint8_t *code;
+    size_t size;
+    uint8_t *entry;     // Top of the loop in code.
+    uint64_t entries;
+    uint64_t iterations; // Bumped by the native code at each back-edge.
+} Trace;
+
+// Back-edges before recording starts, or -1 to never trace.
+extern int traceThreshold;
+// Whether the interpreter is recording; run() passes every instruction it
+// executes to traceRecord() while this is set.
+extern bool traceRecording;
+
+// Counts a back-edge to frame->ip, which has just been taken, and returns
+// the loop's compiled trace if it has one. Starts recording when the loop
+// becomes hot.
+Trace *traceLoop(CallFrame *frame);
+// Records the instruction at frame->ip, advances ip past its opcode and
+// returns the opcode run() should execute. Superinstructions are recorded
+// and executed one component at a time.
+uint8_t traceRecord(CallFrame *frame);
+void traceAbort();
+// Runs trace from the top of its loop in frame. On a side exit the top
+// frame's ip is left where the interpreter must resume.
+InterpretResult traceRun(Trace *trace, CallFrame *frame);
+
+void markTraces(Trace *trace);
+void markTraceRecorder();
+void freeTraces(Trace *trace);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -5,6 +5,11 @@
 #include "chunk.h"
 #include "disassembler/debug.h"
 #include "disassembler/lineinfo.h"
+#include "disassembler/profile.h"
+#include "memory.h"
+#include "vm/jit.h"
+#include "vm/regcode.h"
+#include "vm/trace.h"
 #include "vm/vm.h"
 
 static void repl()
@@ -13,6 +18,7 @@ static void repl()
     for (;;)
     {
         printf("> ");
+        flushOutput();
 
         if (!fgets(line, sizeof(line), stdin))
         {
@@ -63,35 +69,134 @@ static void runFile(const char *path)
     InterpretResult result = interpret(source);
     free(source);
 
+    if (profileOps)
+        printOpcodeProfile();
+    if (gcStats)
+        printGcStats();
+
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
     if (result == INTERPRET_RUNTIME_ERROR)
         exit(70);
 }
 
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [path] [--debug] [--profile-ops] "
+                    "[--gc-stats] [--jit] [--jit-all] [--trace] "
+                    "[--register] [--generational] [--incremental] "
+                    "[--gc-step n] [--concurrent] [--gc-threads n] "
+                    "[--lazy-sweep] [--max-frames n]\n");
+    exit(64);
+}
+
 bool debug = false;
+bool profileOps = false;
+bool gcStats = false;
 int main(int argc, const char *argv[])
 {
-    initVM();
-
-    if (argc == 1)
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++)
     {
-        repl();
-    }
-    else if (argc >= 2 && argc <= 3)
-    {
-        if (argc == 3 && strcmp(argv[2], "--debug") == 0)
+        if (strcmp(argv[i], "--debug") == 0)
         {
             debug = true;
         }
-        runFile(argv[1]);
+        else if (strcmp(argv[i], "--profile-ops") == 0)
+        {
+            profileOps = true;
+        }
+        else if (strcmp(argv[i], "--gc-stats") == 0)
+        {
+            gcStats = true;
+        }
+        else if (strcmp(argv[i], "--jit") == 0)
+        {
+            jitThreshold = JIT_HOT_CALLS;
+        }
+        else if (strcmp(argv[i], "--jit-all") == 0)
+        {
+            jitThreshold = 0;
+        }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            traceThreshold = TRACE_HOT_LOOPS;
+        }
+        else if (strcmp(argv[i], "--register") == 0)
+        {
+            registerVM = true;
+        }
+        // The collector is generational, incremental, concurrent or lazily
+        // swept; the last of the four flags wins.
+        else if (strcmp(argv[i], "--generational") == 0)
+        {
+            generationalGC = true;
+            incrementalGC = concurrentGC = lazySweep = false;
+        }
+        else if (strcmp(argv[i], "--incremental") == 0)
+        {
+            incrementalGC = true;
+            generationalGC = concurrentGC = lazySweep = false;
+        }
+        else if (strcmp(argv[i], "--concurrent") == 0)
+        {
+            concurrentGC = true;
+            generationalGC = incrementalGC = lazySweep = false;
+        }
+        else if (strcmp(argv[i], "--lazy-sweep") == 0)
+        {
+            lazySweep = true;
+            generationalGC = incrementalGC = concurrentGC = false;
+        }
+        else if (strcmp(argv[i], "--gc-step") == 0)
+        {
+            if (i + 1 == argc || (gcStepBudget = atoi(argv[++i])) < 1)
+                usage();
+        }
+        else if (strcmp(argv[i], "--gc-threads") == 0)
+        {
+            if (i + 1 == argc || (gcThreads = atoi(argv[++i])) < 1)
+                usage();
+        }
+        else if (strcmp(argv[i], "--max-frames") == 0)
+        {
+            if (i + 1 == argc || (maxFrames = atoi(argv[++i])) < 1)
+                usage();
+        }
+        else if (path == NULL && strncmp(argv[i], "--", 2) != 0)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    // The JIT and the tracer compile stack bytecode, which register code
+    // does not run.
+    if (registerVM)
+    {
+        jitThreshold = -1;
+        traceThreshold = -1;
+    }
+
+    // Only the stop-the-world collector that sweeps before it returns runs
+    // on several threads.
+    if (generationalGC || incrementalGC || concurrentGC || lazySweep)
+        gcThreads = 1;
+
+    initVM();
+
+    if (path == NULL)
+    {
+        repl();
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "disassembler/lineinfo.h"
@@ -11,8 +12,16 @@ void initChunk(Chunk *chunk)
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->original = NULL;
   initLineInfoArray(&chunk->lineinfos);
   initValueArray(&chunk->constants);
+  chunk->propertyCacheCount = 0;
+  chunk->propertyCacheCapacity = 0;
+  chunk->propertyCaches = NULL;
+  chunk->methodCacheCount = 0;
+  chunk->methodCacheCapacity = 0;
+  chunk->methodCaches = NULL;
+  chunk->traces = NULL;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, LineInfo line)
@@ -31,6 +40,15 @@ void writeChunk(Chunk *chunk, uint8_t byte, LineInfo line)
   chunk->count++;
 }
 
+// Drops the code from count onwards, for the compiler to rewrite it.
+void truncateChunk(Chunk *chunk, int count)
+{
+  LineInfoArray *lines = &chunk->lineinfos;
+  while (lines->count > 0 && lines->lineinfos[lines->count - 1].offset >= count)
+    lines->count--;
+  chunk->count = count;
+}
+
 int addConstant(Chunk *chunk, Value value)
 {
   push(value);
@@ -39,6 +57,37 @@ int addConstant(Chunk *chunk, Value value)
   return chunk->constants.count - 1;
 }
 
+int addPropertyCache(Chunk *chunk)
+{
+  if (chunk->propertyCacheCapacity < chunk->propertyCacheCount + 1)
+  {
+    int oldCapacity = chunk->propertyCacheCapacity;
+    chunk->propertyCacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->propertyCaches = GROW_ARRAY(PropertyCache, chunk->propertyCaches,
+                                       oldCapacity,
+                                       chunk->propertyCacheCapacity);
+  }
+
+  PropertyCache *cache = &chunk->propertyCaches[chunk->propertyCacheCount];
+  memset(cache, 0, sizeof(PropertyCache));
+  return chunk->propertyCacheCount++;
+}
+
+int addMethodCache(Chunk *chunk)
+{
+  if (chunk->methodCacheCapacity < chunk->methodCacheCount + 1)
+  {
+    int oldCapacity = chunk->methodCacheCapacity;
+    chunk->methodCacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->methodCaches = GROW_ARRAY(MethodCache, chunk->methodCaches,
+                                     oldCapacity, chunk->methodCacheCapacity);
+  }
+
+  MethodCache *cache = &chunk->methodCaches[chunk->methodCacheCount];
+  memset(cache, 0, sizeof(MethodCache));
+  return chunk->methodCacheCount++;
+}
+
 void writeConstant(Chunk* chunk, Value value, LineInfo line)
 {
   int constant = addConstant(chunk, value);
@@ -56,7 +105,162 @@ void writeConstant(Chunk* chunk, Value value, LineInfo line)
 void freeChunk(Chunk *chunk)
 {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  if (chunk->original != NULL)
+    FREE_ARRAY(uint8_t, chunk->original, chunk->count);
   freeLineInfoArray(&chunk->lineinfos);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(PropertyCache, chunk->propertyCaches,
+             chunk->propertyCacheCapacity);
+  FREE_ARRAY(MethodCache, chunk->methodCaches, chunk->methodCacheCapacity);
   initChunk(chunk);
 }
+
+// Returns the size in bytes of the instruction at offset, operands included.
+// A superinstruction is as long as its first component.
+int instructionLength(Chunk *chunk, int offset)
+{
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction)
+  {
+#define SUPERINSTRUCTION2(name, a, b) \
+  case name:                          \
+    instruction = a;                  \
+    break;
+#define SUPERINSTRUCTION3(name, a, b, c) \
+  case name:                             \
+    instruction = a;                     \
+    break;
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+  default:
+    break;
+  }
+
+  switch (instruction)
+  {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CLASS:
+  case OP_METHOD:
+    return 2;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+    return 3;
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+    return 4;
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_TAIL_SUPER_INVOKE:
+    return 5;
+  case OP_CLOSURE:
+  {
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + 2 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+
+// Returns the instruction the VM runs at offset, seen through quickening and
+// superinstructions: a quickened instruction's generic form, or a
+// superinstruction's first component.
+uint8_t baseOpcode(Chunk *chunk, int offset)
+{
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction)
+  {
+  case OP_ADD_NUM:
+  case OP_SUBTRACT_NUM:
+  case OP_MULTIPLY_NUM:
+  case OP_DIVIDE_NUM:
+  case OP_LESS_NUM:
+  case OP_GREATER_NUM:
+    return chunk->original[offset];
+#define SUPERINSTRUCTION2(name, a, b) \
+  case name:                          \
+    return a;
+#define SUPERINSTRUCTION3(name, a, b, c) \
+  case name:                             \
+    return a;
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+  default:
+    return instruction;
+  }
+}
+
+typedef struct
+{
+  uint8_t op;
+  uint8_t components[3];
+  int length;
+} Superinstruction;
+
+// Longer sequences come first so they win over the pairs they start with.
+// The table ends with an empty entry so it is never zero-sized.
+static const Superinstruction superinstructions[] = {
+#define SUPERINSTRUCTION2(name, a, b)
+#define SUPERINSTRUCTION3(name, a, b, c) {name, {a, b, c}, 3},
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+#define SUPERINSTRUCTION2(name, a, b) {name, {a, b, 0}, 2},
+#define SUPERINSTRUCTION3(name, a, b, c)
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+    {0, {0, 0, 0}, 0},
+};
+
+static bool matchesSuperinstruction(Chunk *chunk, int offset,
+                                    const Superinstruction *super)
+{
+  for (int i = 0; i < super->length; i++)
+  {
+    if (offset >= chunk->count || chunk->code[offset] != super->components[i])
+      return false;
+    offset += instructionLength(chunk, offset);
+  }
+  return true;
+}
+
+// Replaces the first opcode of every sequence that has a superinstruction.
+// Operands and the later components' opcodes are left where they are: the
+// fused handler skips over them, and a jump that lands inside the sequence
+// still finds the plain instruction it expects.
+void fuseSuperinstructions(Chunk *chunk)
+{
+  int count = sizeof(superinstructions) / sizeof(superinstructions[0]) - 1;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset))
+  {
+    for (int i = 0; i < count; i++)
+    {
+      if (matchesSuperinstruction(chunk, offset, &superinstructions[i]))
+      {
+        chunk->code[offset] = superinstructions[i].op;
+        break;
+      }
+    }
+  }
+}
@@ -1,19 +1,104 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "vm/jit.h"
+#include "vm/regcode.h"
+#include "vm/trace.h"
 #include "vm/vm.h"
 
-#ifdef DEBUG_LOG_GC
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef DEBUG_LOG_GC
 #include "disassembler/debug.h"
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between minor collections under --generational, and
+// the minor collections an object must survive to be promoted.
+#define GC_NURSERY_SIZE (2 * 1024 * 1024)
+#define GC_PROMOTION_AGE 2
+// Bytes allocated between the steps of an incremental collection, and the
+// objects each step traces unless --gc-step says otherwise.
+#define GC_STEP_SIZE (64 * 1024)
+#define GC_STEP_BUDGET 2000
+// Objects in each stretch of vm.objects one thread sweeps under
+// --gc-threads, and the most gray objects a thread steals at once.
+#define GC_REGION_SIZE 4096
+#define GC_STEAL_MAX 256
+// Objects each allocation sweeps under --lazy-sweep.
+#define GC_SWEEP_STEP 1024
+
+bool generationalGC = false;
+bool incrementalGC = false;
+int gcStepBudget = GC_STEP_BUDGET;
+bool gcMarking = false;
+bool concurrentGC = false;
+bool gcConcurrentMarking = false;
+int gcThreads = 1;
+bool lazySweep = false;
+
+// Under --gc-threads, each thread's own gray objects while marking, and
+// where it counts the bytes it frees while sweeping. Both are NULL on
+// threads that are not doing either.
+typedef struct {
+  pthread_mutex_t lock;
+  int count;
+  int capacity;
+  Obj** objects;
+} MarkQueue;
+
+static _Thread_local MarkQueue* markQueue = NULL;
+static _Thread_local size_t* sweptBytes = NULL;
+
+// The marking thread, started with the first collection under
+// --concurrent. It marks while markRequested is set, then sets
+// markFinished.
+static pthread_t marker;
+static bool markerStarted = false;
+static pthread_mutex_t markerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markerWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markerDone = PTHREAD_COND_INITIALIZER;
+static bool markRequested = false;
+static bool markFinished = false;
+static double markerSeconds = 0;
+// Under --concurrent, the bytes allocated past which the mutator waits for
+// the marking thread instead of outrunning it.
+static size_t markingLimit;
+
+// Under --lazy-sweep, the bytes allocated when the last collection
+// finished marking, less those sweeping has freed since.
+static size_t markedBytes;
+
+static void sweepStep();
+
+static void deferFree(void* pointer) {
+  if (vm.deferredCapacity < vm.deferredCount + 1) {
+    vm.deferredCapacity = GROW_CAPACITY(vm.deferredCapacity);
+    vm.deferred = (void**)realloc(vm.deferred,
+                                  sizeof(void*) * vm.deferredCapacity);
+    if (vm.deferred == NULL) exit(1);
+  }
+
+  vm.deferred[vm.deferredCount++] = pointer;
+}
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
+  if (sweptBytes != NULL)
+  {
+    *sweptBytes += oldSize;
+    free(pointer);
+    return NULL;
+  }
+
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
+    if (vm.unswept != NULL) sweepStep();
 #ifdef DEBUG_STRESS_GC
     collectGarbage();
 #endif
@@ -23,10 +108,24 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
   }
   if (newSize == 0)
   {
-    free(pointer);
+    if (gcConcurrentMarking)
+      deferFree(pointer);
+    else
+      free(pointer);
     return NULL;
   }
 
+  // The marking thread may be reading the old block.
+  if (gcConcurrentMarking && pointer != NULL)
+  {
+    void *result = malloc(newSize);
+    if (result == NULL)
+      exit(1);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    deferFree(pointer);
+    return result;
+  }
+
   void *result = realloc(pointer, newSize);
 
   if (result == NULL)
@@ -34,9 +133,68 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
   return result;
 }
 
+void rememberObject(Obj* object) {
+  object->isRemembered = true;
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = (Obj**)realloc(vm.remembered,
+                                   sizeof(Obj*) * vm.rememberedCapacity);
+    if (vm.remembered == NULL) exit(1);
+  }
+
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+void logObject(Obj* object) {
+  if (vm.loggedCapacity < vm.loggedCount + 1) {
+    vm.loggedCapacity = GROW_CAPACITY(vm.loggedCapacity);
+    vm.logged = (Obj**)realloc(vm.logged,
+                               sizeof(Obj*) * vm.loggedCapacity);
+    if (vm.logged == NULL) exit(1);
+  }
+
+  vm.logged[vm.loggedCount++] = object;
+}
+
+// Functions, classes and shapes hold caches and tables that many paths
+// write to. There are few of them, so once old they stay remembered and
+// minor collections trace them every time, instead of each of those writes
+// taking a barrier.
+static bool isAlwaysRemembered(Obj* object) {
+  return object->type == OBJ_FUNCTION || object->type == OBJ_CLASS ||
+         object->type == OBJ_SHAPE;
+}
+
+// Set when markObject() meets a young object that is already marked.
+static bool sawYoung;
+
+static void pushMarkQueue(MarkQueue* queue, Obj* object) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->capacity < queue->count + 1) {
+    queue->capacity = GROW_CAPACITY(queue->capacity);
+    queue->objects = (Obj**)realloc(queue->objects,
+                                    sizeof(Obj*) * queue->capacity);
+    if (queue->objects == NULL) exit(1);
+  }
+
+  queue->objects[queue->count++] = object;
+  pthread_mutex_unlock(&queue->lock);
+}
+
 void markObject(Obj* object) {
   if (object == NULL) return;
-  if (object->isMarked) return;
+  // Other threads may be marking it too: only the one that sets the bit
+  // traces it.
+  if (markQueue != NULL) {
+    if (!__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) {
+      pushMarkQueue(markQueue, object);
+    }
+    return;
+  }
+  if (object->isMarked) {
+    sawYoung |= !object->isOld;
+    return;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
@@ -66,6 +224,23 @@ static void markArray(ValueArray* array) {
   }
 }
 
+static void markPropertyCaches(Chunk* chunk) {
+  for (int i = 0; i < chunk->propertyCacheCount; i++) {
+    PropertyCache* cache = &chunk->propertyCaches[i];
+    for (int j = 0; j < PROPERTY_CACHE_WAYS; j++) {
+      markObject((Obj*)cache->entries[j].shape);
+      markObject((Obj*)cache->entries[j].transition);
+    }
+  }
+}
+
+static void markMethodCaches(Chunk* chunk) {
+  for (int i = 0; i < chunk->methodCacheCount; i++) {
+    markObject(chunk->methodCaches[i].key);
+    markObject((Obj*)chunk->methodCaches[i].method);
+  }
+}
+
 static void blackenObject(Obj* object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
@@ -80,14 +255,39 @@ static void blackenObject(Obj* object) {
       break;
     }
     case OBJ_NATIVE:
+      break;
     case OBJ_STRING:
+      if (!((ObjString*)object)->interned) {
+        ObjLazyString* string = (ObjLazyString*)object;
+        markObject((Obj*)string->canonical);
+        markObject((Obj*)string->left);
+        markObject((Obj*)string->right);
+      }
       break;
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
+      // The shape before the slots, which are at least as many then. The
+      // slots may already be gone, moved into the fields.
+      ObjShape* shape = OBSERVE(instance->shape);
+      Value* slots = instance->slots;
+      if (shape != NULL) {
+        markObject((Obj*)shape);
+        for (int i = 0; slots != NULL && i < shape->slotCount; i++) {
+          markValue(slots[i]);
+        }
+      }
       markTable(&instance->fields);
       break;
     }
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      markTable(&shape->slots);
+      markTable(&shape->transitions);
+      break;
+    }
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
       break;
@@ -95,11 +295,16 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(&function->chunk.constants);
+      markPropertyCaches(&function->chunk);
+      markMethodCaches(&function->chunk);
+      markTraces(function->chunk.traces);
       break;
     case OBJ_CLASS: {
       ObjClass* klass = (ObjClass*)object;
       markObject((Obj*)klass->name);
       markTable(&klass->methods);
+      markObject((Obj*)klass->initializer);
+      markObject((Obj*)klass->rootShape);
       break;
     }
     case OBJ_CLOSURE: {
@@ -108,6 +313,10 @@ static void blackenObject(Obj* object) {
       for (int i = 0; i < closure->upvalueCount; i++) {
         markObject((Obj*)closure->upvalues[i]);
       }
+      ObjUpvalue* cells = closureCells(closure);
+      for (int i = 0; i < closure->cellCount; i++) {
+        markValue(cells[i].closed);
+      }
       break;
     }
     }
@@ -130,18 +339,30 @@ static void freeObject(Obj* object) {
     }
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      if (!string->interned) {
+        ObjLazyString* lazy = (ObjLazyString*)object;
+        if (lazy->chars != NULL)
+          FREE_ARRAY(char, lazy->chars, lazy->length + 1);
+        FREE(ObjLazyString, object);
+        break;
+      }
+      reallocate(object, sizeof(ObjString) + string->length + 1, 0);
       break;
     }
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
+      if (function->jit != NULL)
+        jitFree(function->jit);
+      if (function->regcode != NULL)
+        freeRegCode(function->regcode);
+      freeTraces(function->chunk.traces);
       freeChunk(&function->chunk);
       FREE(ObjFunction, object);
       break;
     }
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
+      FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
       freeTable(&instance->fields);
       FREE(ObjInstance, object);
       break;
@@ -149,11 +370,17 @@ static void freeObject(Obj* object) {
     case OBJ_NATIVE:
       FREE(ObjNative, object);
       break;
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(&shape->slots);
+      freeTable(&shape->transitions);
+      FREE(ObjShape, object);
+      break;
+    }
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
-      FREE_ARRAY(ObjUpvalue*, closure->upvalues,
-                 closure->upvalueCount);
-      FREE(ObjClosure, object);
+      reallocate(object,
+                 closureSize(closure->upvalueCount, closure->cellCount), 0);
       break;
     case OBJ_UPVALUE:
       FREE(ObjUpvalue, object);
@@ -163,7 +390,17 @@ static void freeObject(Obj* object) {
 }
 
 static void markRoots() {
-  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+  // A frame running register code keeps its temporaries in all of its
+  // slots, including those above vm.stackTop while it sets up a call.
+  Value* top = vm.stackTop;
+  for (int i = 0; i < vm.frameCount; i++) {
+    RegCode* regcode = vm.frames[i].closure->function->regcode;
+    if (regcode != NULL && vm.frames[i].slots + regcode->frameSize > top) {
+      top = vm.frames[i].slots + regcode->frameSize;
+    }
+  }
+
+  for (Value* slot = vm.stack; slot < top; slot++) {
     markValue(*slot);
   }
 
@@ -177,9 +414,12 @@ static void markRoots() {
     markObject((Obj*)upvalue);
   }
 
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalNames);
+  markArray(&vm.globalValues);
 
   markCompilerRoots();
+  markTraceRecorder();
 
   markObject((Obj*)vm.initString);
 }
@@ -222,18 +462,637 @@ static void sweep() {
   }
 }
 
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
+// Sweeps up to budget objects of vm.unswept, moving the marked ones back
+// onto vm.objects unmarked. Once all are swept, the next collection is due
+// when the heap has grown by GC_HEAP_GROW_FACTOR from what survived.
+static void sweepUnswept(size_t budget) {
   size_t before = vm.bytesAllocated;
-#endif
+  while (vm.unswept != NULL && budget-- > 0) {
+    Obj* object = vm.unswept;
+    vm.unswept = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->next = vm.objects;
+      vm.objects = object;
+    } else {
+      freeObject(object);
+    }
+  }
+
+  markedBytes -= before - vm.bytesAllocated;
+  if (vm.unswept == NULL) vm.nextGC = markedBytes * GC_HEAP_GROW_FACTOR;
+}
 
+// Frees the young objects nothing reached. Survivors move to the old
+// generation once they have survived GC_PROMOTION_AGE minor collections,
+// or straight away when promoteAll is set. They stay marked, so minor
+// collections take them as live until a major collection unmarks them.
+// Returns the old generation as it was before.
+static Obj* sweepYoung(bool promoteAll) {
+  Obj* old = vm.oldObjects;
+  Obj* previous = NULL;
+  Obj* object = vm.objects;
+  while (object != NULL) {
+    Obj* next = object->next;
+    if (object->isMarked &&
+        !promoteAll && ++object->age < GC_PROMOTION_AGE) {
+      previous = object;
+      object = next;
+      continue;
+    }
+
+    if (previous != NULL) {
+      previous->next = next;
+    } else {
+      vm.objects = next;
+    }
+    if (object->isMarked) {
+      object->isOld = true;
+      object->next = vm.oldObjects;
+      vm.oldObjects = object;
+      if (isAlwaysRemembered(object)) rememberObject(object);
+    } else {
+      freeObject(object);
+    }
+    object = next;
+  }
+  return old;
+}
+
+static void sweepOld() {
+  Obj* previous = NULL;
+  Obj* object = vm.oldObjects;
+  while (object != NULL) {
+    if (object->isMarked) {
+      if (isAlwaysRemembered(object)) rememberObject(object);
+      previous = object;
+      object = object->next;
+    } else {
+      Obj* unreached = object;
+      object = object->next;
+      if (previous != NULL) {
+        previous->next = object;
+      } else {
+        vm.oldObjects = object;
+      }
+
+      freeObject(unreached);
+    }
+  }
+}
+
+// Whether object refers to a young object. Everything it refers to must
+// be marked.
+static bool refersToYoung(Obj* object) {
+  sawYoung = false;
+  blackenObject(object);
+  return sawYoung;
+}
+
+// Traces only from the roots and the remembered objects, skipping the
+// old generation, which is already marked.
+static void minorCollection() {
   markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
   traceReferences();
   tableRemoveWhite(&vm.strings);
+  Obj* old = sweepYoung(false);
+
+  // Old objects stay remembered while they refer to young survivors, and
+  // those just promoted are remembered if they do.
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+    if (isAlwaysRemembered(object) || refersToYoung(object)) {
+      vm.remembered[count++] = object;
+    } else {
+      object->isRemembered = false;
+    }
+  }
+  vm.rememberedCount = count;
+  for (Obj* object = vm.oldObjects; object != old; object = object->next) {
+    if (!object->isRemembered && refersToYoung(object)) {
+      rememberObject(object);
+    }
+  }
+
+  for (Obj* object = vm.objects; object != NULL; object = object->next) {
+    object->isMarked = false;
+  }
+  vm.minorCollections++;
+}
+
+// Traces everything. Young survivors are all promoted, so only the old
+// objects that are always remembered stay in vm.remembered.
+static void majorCollection() {
+  for (Obj* object = vm.oldObjects; object != NULL; object = object->next) {
+    object->isMarked = false;
+  }
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+
+  markRoots();
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+  sweepOld();
+  sweepYoung(true);
+  vm.nextMajorGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+// Traces the gray objects left, including those snapshotBarrier() logged
+// and those the mutator made reachable from the roots or from the
+// functions, classes and shapes marking passed while it ran. Those are
+// written to without a barrier.
+static void finishMarking() {
+  for (int i = 0; i < vm.loggedCount; i++) {
+    markObject(vm.logged[i]);
+  }
+  vm.loggedCount = 0;
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+    blackenObject(vm.remembered[i]);
+  }
+  vm.rememberedCount = 0;
+  traceReferences();
+}
+
+// Runs one step of an incremental collection, starting one if none is
+// marking. Objects allocated meanwhile are left unmarked: they survive if
+// the roots or a barrier reach them by the time marking ends.
+static void incrementalStep() {
+  if (!gcMarking) {
+    markRoots();
+    gcMarking = true;
+  }
+
+  for (int work = 0; work < gcStepBudget && vm.grayCount > 0; work++) {
+    Obj* object = vm.grayStack[--vm.grayCount];
+    blackenObject(object);
+    if (isAlwaysRemembered(object) && !object->isRemembered) {
+      rememberObject(object);
+    }
+  }
+  vm.incrementalSteps++;
+
+  if (vm.grayCount > 0) {
+    vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    return;
+  }
+
+  finishMarking();
+  gcMarking = false;
+  tableRemoveWhite(&vm.strings);
   sweep();
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.collections++;
+}
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Under --lazy-sweep, the sweeping an allocation does before it takes
+// memory of its own.
+static void sweepStep() {
+  double start = now();
+  sweepUnswept(GC_SWEEP_STEP);
+  vm.sweepSteps++;
+
+  double pause = now() - start;
+  vm.gcSeconds += pause;
+  if (pause > vm.longestPause) vm.longestPause = pause;
+}
+
+// Stop-the-world marking that leaves the marked objects on vm.unswept for
+// the allocations that follow to sweep. What the last collection left
+// unswept still carries its marks, so it is swept first.
+static void lazyCollection() {
+  sweepUnswept(SIZE_MAX);
+  markRoots();
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+
+  vm.unswept = vm.objects;
+  vm.objects = NULL;
+  markedBytes = vm.bytesAllocated;
+  // Sweeping only shrinks the heap; sweepUnswept() lowers this once it
+  // knows how much survived.
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+// Traces the gray stack, on the marking thread. Functions, classes and
+// shapes are only put in vm.remembered: the mutator writes to them without
+// a barrier, so finishMarking() traces them with the mutator stopped.
+static void* runMarker(void* unused) {
+  pthread_mutex_lock(&markerLock);
+  for (;;) {
+    while (!markRequested) pthread_cond_wait(&markerWake, &markerLock);
+    markRequested = false;
+    pthread_mutex_unlock(&markerLock);
+
+    double start = now();
+    while (vm.grayCount > 0) {
+      Obj* object = vm.grayStack[--vm.grayCount];
+      if (isAlwaysRemembered(object)) {
+        rememberObject(object);
+      } else {
+        blackenObject(object);
+      }
+    }
+
+    pthread_mutex_lock(&markerLock);
+    markerSeconds += now() - start;
+    markFinished = true;
+    pthread_cond_signal(&markerDone);
+  }
+  return NULL;
+}
+
+static void startMarker() {
+  if (!markerStarted) {
+    if (pthread_create(&marker, NULL, runMarker, NULL) != 0) exit(1);
+    markerStarted = true;
+  }
+
+  pthread_mutex_lock(&markerLock);
+  markFinished = false;
+  markRequested = true;
+  pthread_cond_signal(&markerWake);
+  pthread_mutex_unlock(&markerLock);
+}
+
+// Whether the marking thread has traced all it can, waiting for it to if
+// wait is set.
+static bool markerFinished(bool wait) {
+  pthread_mutex_lock(&markerLock);
+  while (wait && !markFinished) {
+    pthread_cond_wait(&markerDone, &markerLock);
+  }
+  bool finished = markFinished;
+  pthread_mutex_unlock(&markerLock);
+  return finished;
+}
+
+// Marks the roots and leaves the rest to the marking thread, or, once it
+// is done, finishes marking and sweeps. Objects allocated meanwhile are
+// born marked.
+static void concurrentCollection() {
+  if (!gcConcurrentMarking) {
+    markRoots();
+    gcConcurrentMarking = true;
+    markingLimit = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    startMarker();
+    vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    return;
+  }
+
+  if (!markerFinished(vm.bytesAllocated > markingLimit)) {
+    vm.nextGC = vm.bytesAllocated + GC_STEP_SIZE;
+    return;
+  }
+
+  gcConcurrentMarking = false;
+  finishMarking();
+  for (int i = 0; i < vm.deferredCount; i++) {
+    free(vm.deferred[i]);
+  }
+  vm.deferredCount = 0;
+  tableRemoveWhite(&vm.strings);
+  sweep();
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  vm.collections++;
+}
+
+void trackRegion(Obj* object) {
+  if (++vm.regionObjects < GC_REGION_SIZE) return;
+  vm.regionObjects = 0;
+  if (vm.regionCapacity < vm.regionCount + 1) {
+    vm.regionCapacity = GROW_CAPACITY(vm.regionCapacity);
+    vm.regions = (Obj**)realloc(vm.regions,
+                                sizeof(Obj*) * vm.regionCapacity);
+    if (vm.regions == NULL) exit(1);
+  }
+
+  vm.regions[vm.regionCount++] = object;
+}
+
+// The threads besides this one that --gc-threads starts, which run
+// workJob each time workGeneration changes.
+static pthread_t* workers = NULL;
+static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static void (*workJob)(int worker);
+static int workGeneration = 0;
+static int workersBusy = 0;
+
+static void* runWorker(void* argument) {
+  int worker = (int)(intptr_t)argument;
+  int generation = 0;
+  pthread_mutex_lock(&workLock);
+  for (;;) {
+    while (workGeneration == generation) {
+      pthread_cond_wait(&workReady, &workLock);
+    }
+    generation = workGeneration;
+    void (*job)(int) = workJob;
+    pthread_mutex_unlock(&workLock);
+
+    job(worker);
+
+    pthread_mutex_lock(&workLock);
+    if (--workersBusy == 0) pthread_cond_signal(&workDone);
+  }
+  return NULL;
+}
+
+// Runs job on every thread, this one as worker 0, and waits for them all.
+static void runOnWorkers(void (*job)(int worker)) {
+  if (workers == NULL) {
+    workers = (pthread_t*)malloc(sizeof(pthread_t) * gcThreads);
+    if (workers == NULL) exit(1);
+    for (int i = 1; i < gcThreads; i++) {
+      if (pthread_create(&workers[i], NULL, runWorker,
+                         (void*)(intptr_t)i) != 0) {
+        exit(1);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&workLock);
+  workJob = job;
+  workersBusy = gcThreads - 1;
+  workGeneration++;
+  pthread_cond_broadcast(&workReady);
+  pthread_mutex_unlock(&workLock);
+
+  job(0);
+
+  pthread_mutex_lock(&workLock);
+  while (workersBusy > 0) pthread_cond_wait(&workDone, &workLock);
+  pthread_mutex_unlock(&workLock);
+}
+
+static MarkQueue* markQueues = NULL;
+static int idleMarkers;
+
+static Obj* popMarkQueue(MarkQueue* queue) {
+  Obj* object = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count > 0) object = queue->objects[--queue->count];
+  pthread_mutex_unlock(&queue->lock);
+  return object;
+}
+
+// Takes half of another thread's gray objects. Returns whether there were
+// any.
+static bool stealMarkWork(int worker) {
+  Obj* stolen[GC_STEAL_MAX];
+  for (int i = 1; i < gcThreads; i++) {
+    MarkQueue* victim = &markQueues[(worker + i) % gcThreads];
+    if (__atomic_load_n(&victim->count, __ATOMIC_RELAXED) == 0) continue;
+
+    pthread_mutex_lock(&victim->lock);
+    int count = (victim->count + 1) / 2;
+    if (count > GC_STEAL_MAX) count = GC_STEAL_MAX;
+    victim->count -= count;
+    memcpy(stolen, victim->objects + victim->count, sizeof(Obj*) * count);
+    pthread_mutex_unlock(&victim->lock);
+
+    for (int j = 0; j < count; j++) {
+      pushMarkQueue(&markQueues[worker], stolen[j]);
+    }
+    if (count > 0) return true;
+  }
+  return false;
+}
+
+static bool anyMarkWork() {
+  for (int i = 0; i < gcThreads; i++) {
+    if (__atomic_load_n(&markQueues[i].count, __ATOMIC_RELAXED) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Traces gray objects until every thread runs out. A thread that finds
+// none anywhere counts itself idle; once all are, none can make more.
+static void markOnWorker(int worker) {
+  markQueue = &markQueues[worker];
+  for (;;) {
+    Obj* object = popMarkQueue(markQueue);
+    if (object != NULL) {
+      blackenObject(object);
+      continue;
+    }
+    if (stealMarkWork(worker)) continue;
+
+    __atomic_add_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&idleMarkers, __ATOMIC_SEQ_CST) == gcThreads) {
+        markQueue = NULL;
+        return;
+      }
+      if (anyMarkWork()) {
+        __atomic_sub_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+// A stretch of vm.objects, from start up to the next one's, and what
+// sweeping it left.
+typedef struct {
+  Obj* start;
+  Obj* first;
+  Obj* last;
+  int survivors;
+  // Functions are freed on this thread: freeing their code and traces
+  // touches the JIT's state.
+  Obj* functions;
+} SweepRegion;
+
+static SweepRegion* sweepRegions = NULL;
+static int sweepRegionCount;
+static int nextSweepRegion;
+static size_t* sweptByWorker = NULL;
+
+static void sweepRegion(SweepRegion* region, Obj* end) {
+  region->first = NULL;
+  region->last = NULL;
+  region->survivors = 0;
+  region->functions = NULL;
+  Obj* object = region->start;
+  while (object != end) {
+    Obj* next = object->next;
+    if (object->isMarked) {
+      object->isMarked = false;
+      if (region->last != NULL) {
+        region->last->next = object;
+      } else {
+        region->first = object;
+      }
+      region->last = object;
+      region->survivors++;
+    } else if (object->type == OBJ_FUNCTION) {
+      object->next = region->functions;
+      region->functions = object;
+    } else {
+      freeObject(object);
+    }
+    object = next;
+  }
+}
+
+static void sweepOnWorker(int worker) {
+  sweptByWorker[worker] = 0;
+  sweptBytes = &sweptByWorker[worker];
+  for (;;) {
+    int index = __atomic_fetch_add(&nextSweepRegion, 1, __ATOMIC_RELAXED);
+    if (index >= sweepRegionCount) break;
+    Obj* end = index + 1 < sweepRegionCount
+                   ? sweepRegions[index + 1].start : NULL;
+    sweepRegion(&sweepRegions[index], end);
+  }
+  sweptBytes = NULL;
+}
+
+// Splices the swept regions back into one list, and picks the survivors
+// that start the regions of the next collection so each has at least
+// GC_REGION_SIZE of them.
+static void joinSweepRegions() {
+  Obj* last = NULL;
+  vm.objects = NULL;
+  for (int i = 0; i < sweepRegionCount; i++) {
+    SweepRegion* region = &sweepRegions[i];
+    if (region->first == NULL) continue;
+    if (last != NULL) {
+      last->next = region->first;
+    } else {
+      vm.objects = region->first;
+    }
+    last = region->last;
+  }
+  if (last != NULL) last->next = NULL;
+
+  vm.regionCount = 0;
+  int survivors = 0;
+  for (int i = sweepRegionCount - 1; i >= 0; i--) {
+    SweepRegion* region = &sweepRegions[i];
+    survivors += region->survivors;
+    if (region->first != NULL && survivors >= GC_REGION_SIZE) {
+      vm.regions[vm.regionCount++] = region->first;
+      survivors = 0;
+    }
+  }
+  vm.regionObjects = survivors;
+
+  for (int i = 0; i < sweepRegionCount; i++) {
+    Obj* function = sweepRegions[i].functions;
+    while (function != NULL) {
+      Obj* next = function->next;
+      freeObject(function);
+      function = next;
+    }
+  }
+}
+
+// Stop-the-world collection with the marking and sweeping shared among
+// gcThreads threads.
+static void parallelCollection() {
+  if (markQueues == NULL) {
+    markQueues = (MarkQueue*)calloc(gcThreads, sizeof(MarkQueue));
+    sweptByWorker = (size_t*)calloc(gcThreads, sizeof(size_t));
+    if (markQueues == NULL || sweptByWorker == NULL) exit(1);
+    for (int i = 0; i < gcThreads; i++) {
+      pthread_mutex_init(&markQueues[i].lock, NULL);
+    }
+  }
+
+  markRoots();
+  for (int i = 0; i < vm.grayCount; i++) {
+    pushMarkQueue(&markQueues[i % gcThreads], vm.grayStack[i]);
+  }
+  vm.grayCount = 0;
+  idleMarkers = 0;
+  runOnWorkers(markOnWorker);
+
+  tableRemoveWhite(&vm.strings);
+
+  // The list runs from the newest region to the oldest.
+  sweepRegionCount = vm.regionCount + 1;
+  sweepRegions = (SweepRegion*)realloc(
+      sweepRegions, sizeof(SweepRegion) * sweepRegionCount);
+  if (sweepRegions == NULL) exit(1);
+  sweepRegions[0].start = vm.objects;
+  for (int i = 1; i < sweepRegionCount; i++) {
+    sweepRegions[i].start = vm.regions[vm.regionCount - i];
+  }
+  nextSweepRegion = 0;
+  runOnWorkers(sweepOnWorker);
+  for (int i = 0; i < gcThreads; i++) {
+    vm.bytesAllocated -= sweptByWorker[i];
+  }
+  // Each region may start one of the next collection.
+  if (vm.regionCapacity < sweepRegionCount) {
+    vm.regionCapacity = sweepRegionCount;
+    vm.regions = (Obj**)realloc(vm.regions,
+                                sizeof(Obj*) * vm.regionCapacity);
+    if (vm.regions == NULL) exit(1);
+  }
+  joinSweepRegions();
 
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+}
+
+void collectGarbage() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+  double start = now();
+
+  if (generationalGC) {
+    if (vm.oldBytes > vm.nextMajorGC) {
+      majorCollection();
+    } else {
+      minorCollection();
+    }
+    vm.oldBytes = vm.bytesAllocated;
+    vm.nextGC = vm.bytesAllocated + GC_NURSERY_SIZE;
+    vm.collections++;
+  } else if (incrementalGC) {
+    incrementalStep();
+  } else if (concurrentGC) {
+    concurrentCollection();
+  } else if (gcThreads > 1) {
+    parallelCollection();
+    vm.collections++;
+  } else if (lazySweep) {
+    lazyCollection();
+    vm.collections++;
+  } else {
+    markRoots();
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+    sweep();
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    vm.collections++;
+  }
+
+  double pause = now() - start;
+  vm.gcSeconds += pause;
+  if (pause > vm.longestPause) vm.longestPause = pause;
 
 #ifdef DEBUG_LOG_GC
   printf("-- gc end\n");
@@ -243,13 +1102,65 @@ void collectGarbage() {
 #endif
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
+void printGcStats() {
+  static const char* names[OBJ_TYPE_COUNT] = {
+    [OBJ_BOUND_METHOD] = "bound methods",
+    [OBJ_CLASS] = "classes",
+    [OBJ_STRING] = "strings",
+    [OBJ_FUNCTION] = "functions",
+    [OBJ_INSTANCE] = "instances",
+    [OBJ_NATIVE] = "natives",
+    [OBJ_CLOSURE] = "closures",
+    [OBJ_UPVALUE] = "upvalues",
+    [OBJ_SHAPE] = "shapes",
+  };
+
+  size_t total = 0;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) total += vm.allocations[i];
+  fprintf(stderr, "objects allocated: %zu\n", total);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(stderr, "  %s: %zu\n", names[i], vm.allocations[i]);
+  }
+  fprintf(stderr, "collections: %zu\n", vm.collections);
+  if (generationalGC) {
+    fprintf(stderr, "  minor: %zu\n", vm.minorCollections);
+  } else if (incrementalGC) {
+    fprintf(stderr, "  steps: %zu\n", vm.incrementalSteps);
+  } else if (lazySweep) {
+    fprintf(stderr, "  sweep steps: %zu\n", vm.sweepSteps);
+  } else if (concurrentGC) {
+    pthread_mutex_lock(&markerLock);
+    fprintf(stderr, "  marking thread: %.3f ms\n", markerSeconds * 1000);
+    pthread_mutex_unlock(&markerLock);
+  }
+  fprintf(stderr, "gc time: %.3f ms, longest pause %.3f ms\n",
+          vm.gcSeconds * 1000, vm.longestPause * 1000);
+}
+
+static void freeList(Obj* object) {
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
+}
+
+void freeObjects() {
+  if (gcConcurrentMarking) {
+    markerFinished(true);
+    gcConcurrentMarking = false;
+  }
+  for (int i = 0; i < vm.deferredCount; i++) {
+    free(vm.deferred[i]);
+  }
+
+  freeList(vm.objects);
+  freeList(vm.oldObjects);
+  freeList(vm.unswept);
 
   free(vm.grayStack);
+  free(vm.remembered);
+  free(vm.logged);
+  free(vm.deferred);
+  free(vm.regions);
 }
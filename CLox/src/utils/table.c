@@ -90,7 +90,7 @@ static void adjustCapacity(Table *table, int capacity)
 
     FREE_ARRAY(Entry, table->entries, table->capacity);
     table->entries = entries;
-    table->capacity = capacity;
+    PUBLISH(table->capacity, capacity);
 }
 
 bool tableSet(Table *table, ObjString *key, Value value)
@@ -168,8 +168,12 @@ ObjString *tableFindString(Table *table, const char *chars,
 }
 
 void markTable(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-      Entry* entry = &table->entries[i];
+    // The capacity before the entries: they are at least that large then,
+    // even while another thread grows the table.
+    int capacity = OBSERVE(table->capacity);
+    Entry* entries = table->entries;
+    for (int i = 0; i < capacity; i++) {
+      Entry* entry = &entries[i];
       markObject((Obj*)entry->key);
       markValue(entry->value);
     }
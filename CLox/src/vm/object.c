@@ -14,9 +14,16 @@ static Obj *allocateObject(size_t size, ObjType type)
 {
     Obj *object = (Obj *)reallocate(NULL, 0, size);
     object->type = type;
-    object->isMarked = false;
+    // The marking thread only traces what was reachable when it started.
+    object->isMarked = gcConcurrentMarking;
+    object->isOld = false;
+    object->isRemembered = false;
+    object->age = 0;
     object->next = vm.objects;
     vm.objects = object;
+    vm.allocations[type]++;
+    if (gcThreads > 1)
+        trackRegion(object);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void*)object, size, type);
@@ -37,19 +44,29 @@ ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
     initTable(&klass->methods);
     klass->name = name;
+    klass->initializer = NULL;
+    klass->rootShape = NULL;
+    klass->slotHint = 0;
+    push(OBJ_VAL(klass));
+    klass->rootShape = newShape(NULL, NULL);
+    pop();
     return klass;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
-                                   function->upvalueCount);
-    for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
-    }
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        closureSize(function->upvalueCount, function->cellCount),
+        OBJ_CLOSURE);
     closure->function = function;
-    closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
+    closure->cellCount = function->cellCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
+    ObjUpvalue* cells = closureCells(closure);
+    for (int i = 0; i < closure->cellCount; i++) {
+        cells[i].closed = NIL_VAL;
+    }
     return closure;
 }
 
@@ -60,6 +77,11 @@ ObjFunction* newFunction() {
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+    function->callCount = 0;
+    function->frameOffset = -1;
+    function->cellCount = 0;
+    function->jit = NULL;
+    function->regcode = NULL;
     initChunk(&function->chunk);
     return function;
 }
@@ -67,13 +89,140 @@ ObjFunction* newFunction() {
 ObjInstance* newInstance(ObjClass* klass) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
+    instance->shape = klass->rootShape;
+    instance->slots = NULL;
+    instance->slotCapacity = 0;
     initTable(&instance->fields);
+    // Size the slots for as many fields as earlier instances ended up with,
+    // so that init does not grow them one step at a time.
+    if (klass->slotHint > 0) {
+        push(OBJ_VAL(instance));
+        instance->slots = ALLOCATE(Value, klass->slotHint);
+        instance->slotCapacity = klass->slotHint;
+        pop();
+    }
     return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->slotCount = parent == NULL ? 0 : parent->slotCount + 1;
+    initTable(&shape->slots);
+    initTable(&shape->transitions);
+    if (parent != NULL) {
+        push(OBJ_VAL(shape));
+        tableAddAll(&parent->slots, &shape->slots);
+        tableSet(&shape->slots, name, NUMBER_VAL(parent->slotCount));
+        pop();
+    }
+    return shape;
+}
+
+ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value next;
+    if (tableGet(&shape->transitions, name, &next)) {
+        return AS_SHAPE(next);
+    }
+
+    ObjShape* child = newShape(shape, name);
+    push(OBJ_VAL(child));
+    tableSet(&shape->transitions, name, OBJ_VAL(child));
+    pop();
+    return child;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+    Value slot;
+    if (!tableGet(&shape->slots, name, &slot)) return -1;
+    return (int)AS_NUMBER(slot);
+}
+
+void instanceAppendSlot(ObjInstance* instance, ObjShape* shape,
+                        Value value) {
+    int slot = shape->slotCount - 1;
+    if (slot >= instance->slotCapacity) {
+        int oldCapacity = instance->slotCapacity;
+        instance->slotCapacity = GROW_CAPACITY(oldCapacity);
+        instance->slots = GROW_ARRAY(Value, instance->slots,
+                                     oldCapacity, instance->slotCapacity);
+    }
+    instance->slots[slot] = value;
+    PUBLISH(instance->shape, shape);
+    writeBarrier((Obj*)instance, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(shape));
+    if (shape->slotCount > instance->klass->slotHint) {
+        instance->klass->slotHint = shape->slotCount;
+    }
+}
+
+// Moves every field out of the slot array into the fields table. Used once
+// an instance grows past SHAPE_MAX_SLOTS so the shape tree stays bounded.
+static void toDictionaryMode(ObjInstance* instance) {
+    Table* slots = &instance->shape->slots;
+    for (int i = 0; i < slots->capacity; i++) {
+        Entry* entry = &slots->entries[i];
+        if (entry->key == NULL) continue;
+        Value value = instance->slots[(int)AS_NUMBER(entry->value)];
+        // The marking thread may see the slots go before the fields come.
+        snapshotBarrier(value);
+        tableSet(&instance->fields, entry->key, value);
+        writeBarrier((Obj*)instance, OBJ_VAL(entry->key));
+    }
+
+    instance->shape = NULL;
+    FREE_ARRAY(Value, instance->slots, instance->slotCapacity);
+    instance->slots = NULL;
+    instance->slotCapacity = 0;
+}
+
+bool instanceGetField(ObjInstance* instance, ObjString* name,
+                      Value* value) {
+    if (instance->shape == NULL) {
+        return tableGet(&instance->fields, name, value);
+    }
+
+    int slot = shapeSlot(instance->shape, name);
+    if (slot < 0) return false;
+    *value = instance->slots[slot];
+    return true;
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name,
+                      Value value) {
+    if (instance->shape != NULL) {
+        int slot = shapeSlot(instance->shape, name);
+        if (slot >= 0) {
+            snapshotBarrier(instance->slots[slot]);
+            instance->slots[slot] = value;
+            writeBarrier((Obj*)instance, value);
+            return;
+        }
+
+        if (instance->shape->slotCount < SHAPE_MAX_SLOTS) {
+            instanceAppendSlot(instance,
+                               shapeTransition(instance->shape, name),
+                               value);
+            return;
+        }
+
+        toDictionaryMode(instance);
+    }
+
+    if (gcConcurrentMarking) {
+        Value old;
+        if (tableGet(&instance->fields, name, &old)) snapshotBarrier(old);
+    }
+    tableSet(&instance->fields, name, value);
+    writeBarrier((Obj*)instance, OBJ_VAL(name));
+    writeBarrier((Obj*)instance, value);
+}
+
+ObjNative* newNative(NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
     return native;
 }
 
@@ -85,7 +234,8 @@ void printObject(Value value)
       printFunction(AS_BOUND_METHOD(value)->method->function);
       break;
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        fwrite(stringChars(AS_STRING(value)), 1, AS_STRING(value)->length,
+               stdout);
         break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
@@ -106,16 +256,23 @@ void printObject(Value value)
     case OBJ_UPVALUE:
       printf("upvalue");
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     }
 }
 
-static ObjString *allocateString(char *chars, int length,
+// Copies chars into a new interned string.
+static ObjString *allocateString(const char *chars, int length,
                                  uint32_t hash)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString *string = (ObjString *)allocateObject(
+        sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
+    string->interned = true;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
@@ -139,12 +296,12 @@ ObjString *copyString(const char *chars, int length)
     ObjString *interned = tableFindString(&vm.strings, chars, length,
                                           hash);
     if (interned != NULL)
+    {
+        snapshotBarrier(OBJ_VAL(interned));
         return interned;
+    }
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(chars, length, hash);
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
@@ -163,16 +320,145 @@ static void printFunction(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+// Like copyString(), but frees chars, which the caller allocated, after.
 ObjString *takeString(char *chars, int length)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length,
-                                          hash);
-    if (interned != NULL)
+    ObjString *string = copyString(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
+}
+
+static ObjLazyString *allocateLazyString(char *chars, int length)
+{
+    ObjLazyString *string = ALLOCATE_OBJ(ObjLazyString, OBJ_STRING);
+    string->length = length;
+    string->interned = false;
+    string->hash = 0;
+    string->chars = chars;
+    string->canonical = NULL;
+    string->left = NULL;
+    string->right = NULL;
+    return string;
+}
+
+// Takes ownership of chars, like takeString(), without interning them.
+ObjString *newString(char *chars, int length)
+{
+    return (ObjString *)allocateLazyString(chars, length);
+}
+
+ObjString *newRope(ObjString *left, ObjString *right)
+{
+    ObjLazyString *rope =
+        allocateLazyString(NULL, left->length + right->length);
+    rope->left = left;
+    rope->right = right;
+    return (ObjString *)rope;
+}
+
+static inline bool isRope(ObjString *string)
+{
+    return !string->interned && ((ObjLazyString *)string)->left != NULL;
+}
+
+// Returns a lazy string's characters. A rope's leaves are first copied into
+// one buffer, right to left, which the rope then holds instead of its
+// halves. Ropes grow lopsided, so the walk keeps its own stack instead of
+// recursing.
+const char *flattenString(ObjLazyString *rope)
+{
+    if (rope->canonical != NULL)
+        return rope->canonical->chars;
+    if (rope->chars != NULL)
+        return rope->chars;
+
+    // Allocating may collect, and the caller need not still hold the rope.
+    push(OBJ_VAL(rope));
+    int length = rope->length;
+    char *chars = ALLOCATE(char, length + 1);
+    chars[length] = '\0';
+
+    ObjString *fixed[16];
+    ObjString **pending = fixed;
+    int capacity = 16;
+    int count = 0;
+    pending[count++] = rope->left;
+    pending[count++] = rope->right;
+    while (count > 0)
     {
-        FREE_ARRAY(char, chars, length + 1);
-        return interned;
+        ObjString *string = pending[--count];
+        if (!isRope(string))
+        {
+            length -= string->length;
+            memcpy(chars + length, stringChars(string), string->length);
+            continue;
+        }
+
+        if (count + 2 > capacity)
+        {
+            int oldCapacity = capacity;
+            capacity = GROW_CAPACITY(capacity);
+            if (pending == fixed)
+            {
+                pending = ALLOCATE(ObjString *, capacity);
+                memcpy(pending, fixed, sizeof(fixed));
+            }
+            else
+            {
+                pending = GROW_ARRAY(ObjString *, pending, oldCapacity,
+                                     capacity);
+            }
+        }
+        pending[count++] = ((ObjLazyString *)string)->left;
+        pending[count++] = ((ObjLazyString *)string)->right;
     }
+    if (pending != fixed)
+        FREE_ARRAY(ObjString *, pending, capacity);
 
-    return allocateString(chars, length, hash);
+    rope->chars = chars;
+    rope->left = NULL;
+    rope->right = NULL;
+    pop();
+    return chars;
+}
+
+// Hashes the string and finds its interned equal, copying the string's
+// characters into one if there is none.
+ObjString *internLazyString(ObjLazyString *string)
+{
+    if (string->canonical != NULL)
+        return string->canonical;
+
+    push(OBJ_VAL(string));
+    int length = string->length;
+    const char *chars = flattenString(string);
+    uint32_t hash = hashString(chars, length);
+    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned == NULL)
+        interned = allocateString(chars, length, hash);
+    else
+        snapshotBarrier(OBJ_VAL(interned));
+    FREE_ARRAY(char, string->chars, length + 1);
+    string->chars = NULL;
+    string->hash = hash;
+    string->canonical = interned;
+    writeBarrier((Obj*)string, OBJ_VAL(interned));
+    pop();
+    return interned;
+}
+
+// Interned strings are equal only to themselves. Others are interned to be
+// compared.
+bool stringsEqual(ObjString *a, ObjString *b)
+{
+    if (a == b)
+        return true;
+    if (a->length != b->length || (a->interned && b->interned))
+        return false;
+    // Hold a's interned string while interning b may collect.
+    ObjString *internedA = internString(a);
+    push(OBJ_VAL(internedA));
+    bool equal = internedA == internString(b);
+    pop();
+    return equal;
 }
@@ -0,0 +1,635 @@
+#include <stdlib.h>
+
+#include "vm/regcode.h"
+
+bool registerVM = false;
+
+// Register code is translated from the stack bytecode one instruction at a
+// time, simulating the operand stack. Each simulated entry is the operand
+// that currently holds its value: a slot or a constant. Loading a local or
+// a constant emits nothing, so `a = b + c` with locals becomes a single
+// REG_ADD. An entry whose operand is its own slot is materialized. Entries
+// other than materialized ones only name slots of materialized entries
+// below them, so writing an entry's own slot never clobbers a value still
+// on the simulated stack.
+//
+// Entries are materialized wherever the stack VM's layout is observable:
+// at jumps and their targets, so every path into an instruction agrees on
+// where values are, and before calls, which read their arguments from
+// consecutive slots and may assign locals through upvalues.
+
+typedef struct
+{
+    int at;     // Instruction whose target is patched.
+    int target; // Bytecode offset it jumps to.
+    bool wide;  // Target goes in b and c rather than c alone.
+} RegFixup;
+
+typedef struct
+{
+    ObjFunction *function;
+    Chunk *chunk;
+    RegCode *code;
+    int capacity;
+    int offset;         // Bytecode offset being translated.
+    uint16_t *stack;    // Operand of each simulated stack entry.
+    int depth;
+    int *labels;        // Instruction each bytecode offset starts at.
+    int *targetDepths;  // Depth at each jump target, or -1.
+    RegFixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    // Instructions before this index may be reached by a jump, so they
+    // are never rewritten.
+    int barrier;
+    bool live;          // Whether the previous instruction falls through.
+} Translator;
+
+static void *allocate(size_t size)
+{
+    void *pointer = malloc(size);
+    if (pointer == NULL)
+        exit(1);
+    return pointer;
+}
+
+static int emit(Translator *t, uint8_t op, uint8_t n, uint16_t a,
+                uint16_t b, uint16_t c)
+{
+    RegCode *code = t->code;
+    if (t->capacity < code->count + 1)
+    {
+        t->capacity = t->capacity < 64 ? 64 : t->capacity * 2;
+        code->code = realloc(code->code,
+                             sizeof(RegInstruction) * t->capacity);
+        code->offsets = realloc(code->offsets, sizeof(int) * t->capacity);
+        if (code->code == NULL || code->offsets == NULL)
+            exit(1);
+    }
+
+    RegInstruction *instruction = &code->code[code->count];
+    instruction->op = op;
+    instruction->n = n;
+    instruction->a = a;
+    instruction->b = b;
+    instruction->c = c;
+    code->offsets[code->count] = t->offset;
+    return code->count++;
+}
+
+static void emitWide(Translator *t, uint8_t op, uint16_t a, uint32_t wide)
+{
+    emit(t, op, 0, a, (uint16_t)wide, (uint16_t)(wide >> 16));
+}
+
+static void addFixup(Translator *t, int at, int target, bool wide)
+{
+    if (t->fixupCapacity < t->fixupCount + 1)
+    {
+        t->fixupCapacity = t->fixupCapacity < 16 ? 16 : t->fixupCapacity * 2;
+        t->fixups = realloc(t->fixups, sizeof(RegFixup) * t->fixupCapacity);
+        if (t->fixups == NULL)
+            exit(1);
+    }
+    t->fixups[t->fixupCount++] = (RegFixup){at, target, wide};
+}
+
+static void push(Translator *t, uint16_t operand)
+{
+    t->stack[t->depth++] = operand;
+    if (t->depth > t->code->frameSize)
+        t->code->frameSize = t->depth;
+}
+
+// Pushes a result written to the slot of the entry about to be pushed.
+static uint16_t pushSlot(Translator *t)
+{
+    uint16_t slot = (uint16_t)t->depth;
+    push(t, slot);
+    return slot;
+}
+
+static uint16_t top(Translator *t, int distance)
+{
+    return t->stack[t->depth - 1 - distance];
+}
+
+static void pushConstant(Translator *t, uint32_t index)
+{
+    if (index < REG_CONSTANT)
+    {
+        push(t, (uint16_t)(REG_CONSTANT | index));
+        return;
+    }
+    emitWide(t, REG_LOAD_CONSTANT, (uint16_t)t->depth, index);
+    pushSlot(t);
+}
+
+// Moves every entry that reads slot out of it, before slot is written.
+static void spill(Translator *t, int slot)
+{
+    for (int i = slot + 1; i < t->depth; i++)
+    {
+        if (t->stack[i] == slot)
+        {
+            emit(t, REG_MOVE, 0, (uint16_t)i, (uint16_t)slot, 0);
+            t->stack[i] = (uint16_t)i;
+        }
+    }
+}
+
+static void materialize(Translator *t, int index)
+{
+    if (t->stack[index] == index)
+        return;
+    emit(t, REG_MOVE, 0, (uint16_t)index, t->stack[index], 0);
+    t->stack[index] = (uint16_t)index;
+}
+
+static void materializeAll(Translator *t, int count)
+{
+    for (int i = 0; i < count; i++)
+        materialize(t, i);
+}
+
+// The last instruction emitted, if it can still be rewritten.
+static RegInstruction *lastInstruction(Translator *t)
+{
+    RegCode *code = t->code;
+    if (code->count == 0 || code->count - 1 < t->barrier)
+        return NULL;
+    return &code->code[code->count - 1];
+}
+
+// Whether op computes a value into slot a from operands it reads first, so
+// its result can be sent to another slot.
+static bool writesSlot(uint8_t op)
+{
+    switch (op)
+    {
+    case REG_MOVE:
+    case REG_LOAD_CONSTANT:
+    case REG_GET_GLOBAL:
+    case REG_GET_UPVALUE:
+    case REG_GET_PROPERTY:
+    case REG_EQUAL:
+    case REG_GREATER:
+    case REG_LESS:
+    case REG_ADD:
+    case REG_SUBTRACT:
+    case REG_MULTIPLY:
+    case REG_DIVIDE:
+    case REG_NOT:
+    case REG_NEGATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void setLocal(Translator *t, int slot)
+{
+    uint16_t value = top(t, 0);
+    if (value == slot)
+        return;
+
+    // A result computed into the top slot just before is stored straight
+    // into the local instead, unless something still reads the local.
+    RegInstruction *last = lastInstruction(t);
+    bool read = false;
+    for (int i = slot + 1; i < t->depth - 1; i++)
+        read |= t->stack[i] == slot;
+    if (!read && last != NULL && value == t->depth - 1 &&
+        last->a == value && writesSlot(last->op))
+    {
+        last->a = (uint16_t)slot;
+        t->stack[t->depth - 1] = (uint16_t)slot;
+    }
+    else
+    {
+        spill(t, slot);
+        emit(t, REG_MOVE, 0, (uint16_t)slot, value, 0);
+    }
+    t->stack[slot] = (uint16_t)slot;
+}
+
+static void binary(Translator *t, uint8_t op)
+{
+    uint16_t b = top(t, 1);
+    uint16_t c = top(t, 0);
+    t->depth -= 2;
+    emit(t, op, 0, (uint16_t)t->depth, b, c);
+    pushSlot(t);
+}
+
+static void unary(Translator *t, uint8_t op)
+{
+    uint16_t b = top(t, 0);
+    t->depth--;
+    emit(t, op, 0, (uint16_t)t->depth, b, 0);
+    pushSlot(t);
+}
+
+static int jumpTarget(Chunk *chunk, int offset)
+{
+    uint8_t op = baseOpcode(chunk, offset);
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static void recordTarget(Translator *t, int target)
+{
+    t->targetDepths[target] = t->depth;
+}
+
+static void jump(Translator *t, int target)
+{
+    materializeAll(t, t->depth);
+    recordTarget(t, target);
+    int at = emit(t, REG_JUMP, 0, 0, 0, 0);
+    addFixup(t, at, target, true);
+    t->live = false;
+}
+
+// The stack VM leaves the condition on the stack and pops it on both paths.
+// When both paths start with that OP_POP, the condition need not be
+// materialized, and a comparison computed just before folds into the
+// branch.
+static void jumpIfFalse(Translator *t, int target, int next)
+{
+    Chunk *chunk = t->chunk;
+    bool popped = baseOpcode(chunk, next) == OP_POP &&
+                  baseOpcode(chunk, target) == OP_POP;
+    if (!popped)
+    {
+        materializeAll(t, t->depth);
+        recordTarget(t, target);
+        int at = emit(t, REG_JUMP_IF_FALSE, 0, top(t, 0), 0, 0);
+        addFixup(t, at, target, true);
+        return;
+    }
+
+    uint16_t condition = top(t, 0);
+    materializeAll(t, t->depth - 1);
+    recordTarget(t, target);
+
+    RegInstruction *last = lastInstruction(t);
+    uint8_t fused = 0;
+    if (last != NULL && condition == t->depth - 1 && last->a == condition)
+    {
+        switch (last->op)
+        {
+        case REG_EQUAL:
+            fused = REG_JUMP_UNLESS_EQUAL;
+            break;
+        case REG_GREATER:
+            fused = REG_JUMP_UNLESS_GREATER;
+            break;
+        case REG_LESS:
+            fused = REG_JUMP_UNLESS_LESS;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // The fused forms keep their target in c, which holds any instruction
+    // index when the bytecode itself is that short.
+    if (fused != 0 && chunk->count <= UINT16_MAX)
+    {
+        last->op = fused;
+        last->a = last->b;
+        last->b = last->c;
+        addFixup(t, t->code->count - 1, target, false);
+    }
+    else
+    {
+        int at = emit(t, REG_JUMP_IF_FALSE, 0, condition, 0, 0);
+        addFixup(t, at, target, true);
+    }
+}
+
+// Jumps and the instructions they land on, found before translating so that
+// the simulated stack can be materialized on arrival at a loop header.
+static bool *findTargets(Chunk *chunk)
+{
+    bool *targets = calloc(chunk->count + 1, sizeof(bool));
+    if (targets == NULL)
+        exit(1);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        switch (baseOpcode(chunk, offset))
+        {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            targets[jumpTarget(chunk, offset)] = true;
+            break;
+        default:
+            break;
+        }
+    }
+    return targets;
+}
+
+static void bindLabel(Translator *t)
+{
+    int depth = t->targetDepths[t->offset];
+    if (t->live)
+        materializeAll(t, t->depth);
+    else if (depth >= 0)
+        t->depth = depth;
+    for (int i = 0; i < t->depth; i++)
+        t->stack[i] = (uint16_t)i;
+    t->barrier = t->code->count;
+}
+
+static void translateInstruction(Translator *t, uint8_t op)
+{
+    Chunk *chunk = t->chunk;
+    uint8_t *operands = chunk->code + t->offset + 1;
+    t->live = true;
+    switch (op)
+    {
+    case OP_CONSTANT:
+        pushConstant(t, operands[0]);
+        break;
+    case OP_CONSTANT_LONG:
+        pushConstant(t, (operands[0] << 16) | (operands[1] << 8) | operands[2]);
+        break;
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        pushConstant(t, chunk->constants.count + (op - OP_NIL));
+        break;
+    case OP_POP:
+        t->depth--;
+        break;
+    case OP_GET_LOCAL:
+        materialize(t, operands[0]);
+        push(t, operands[0]);
+        break;
+    case OP_SET_LOCAL:
+        setLocal(t, operands[0]);
+        break;
+    case OP_GET_GLOBAL:
+        emitWide(t, REG_GET_GLOBAL, (uint16_t)t->depth, operands[0]);
+        pushSlot(t);
+        break;
+    case OP_GET_GLOBAL_LONG:
+        emitWide(t, REG_GET_GLOBAL, (uint16_t)t->depth,
+                 (operands[0] << 16) | (operands[1] << 8) | operands[2]);
+        pushSlot(t);
+        break;
+    case OP_DEFINE_GLOBAL:
+        emitWide(t, REG_DEFINE_GLOBAL, top(t, 0), operands[0]);
+        t->depth--;
+        break;
+    case OP_DEFINE_GLOBAL_LONG:
+        emitWide(t, REG_DEFINE_GLOBAL, top(t, 0),
+                 (operands[0] << 16) | (operands[1] << 8) | operands[2]);
+        t->depth--;
+        break;
+    case OP_SET_GLOBAL:
+        emitWide(t, REG_SET_GLOBAL, top(t, 0), operands[0]);
+        break;
+    case OP_SET_GLOBAL_LONG:
+        emitWide(t, REG_SET_GLOBAL, top(t, 0),
+                 (operands[0] << 16) | (operands[1] << 8) | operands[2]);
+        break;
+    case OP_GET_UPVALUE:
+        emit(t, REG_GET_UPVALUE, 0, (uint16_t)t->depth, operands[0], 0);
+        pushSlot(t);
+        break;
+    case OP_SET_UPVALUE:
+        emit(t, REG_SET_UPVALUE, 0, top(t, 0), operands[0], 0);
+        break;
+    case OP_GET_PROPERTY:
+    {
+        uint16_t receiver = top(t, 0);
+        t->depth--;
+        emit(t, REG_GET_PROPERTY, operands[0], (uint16_t)t->depth, receiver,
+             (uint16_t)((operands[1] << 8) | operands[2]));
+        pushSlot(t);
+        break;
+    }
+    case OP_SET_PROPERTY:
+    {
+        uint16_t value = top(t, 0);
+        emit(t, REG_SET_PROPERTY, operands[0], top(t, 1), value,
+             (uint16_t)((operands[1] << 8) | operands[2]));
+        t->depth -= 2;
+        // The assigned value is the expression's result. It moves down a
+        // slot unless the statement discards it straight away.
+        if (value == t->depth + 1 &&
+            baseOpcode(chunk, t->offset + 4) != OP_POP)
+        {
+            emit(t, REG_MOVE, 0, (uint16_t)t->depth, value, 0);
+            value = (uint16_t)t->depth;
+        }
+        push(t, value);
+        break;
+    }
+    case OP_GET_SUPER:
+        materializeAll(t, t->depth);
+        emit(t, REG_GET_SUPER, operands[0], (uint16_t)(t->depth - 2),
+             (uint16_t)((operands[1] << 8) | operands[2]), 0);
+        t->depth -= 2;
+        pushSlot(t);
+        break;
+    case OP_EQUAL:
+        binary(t, REG_EQUAL);
+        break;
+    case OP_GREATER:
+        binary(t, REG_GREATER);
+        break;
+    case OP_LESS:
+        binary(t, REG_LESS);
+        break;
+    case OP_ADD:
+        binary(t, REG_ADD);
+        break;
+    case OP_SUBTRACT:
+        binary(t, REG_SUBTRACT);
+        break;
+    case OP_MULTIPLY:
+        binary(t, REG_MULTIPLY);
+        break;
+    case OP_DIVIDE:
+        binary(t, REG_DIVIDE);
+        break;
+    case OP_NOT:
+        unary(t, REG_NOT);
+        break;
+    case OP_NEGATE:
+        unary(t, REG_NEGATE);
+        break;
+    case OP_PRINT:
+        emit(t, REG_PRINT, 0, top(t, 0), 0, 0);
+        t->depth--;
+        break;
+    case OP_JUMP:
+    case OP_LOOP:
+        jump(t, jumpTarget(chunk, t->offset));
+        break;
+    case OP_JUMP_IF_FALSE:
+        jumpIfFalse(t, jumpTarget(chunk, t->offset), t->offset + 3);
+        break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        materializeAll(t, t->depth);
+        t->depth -= operands[0] + 1;
+        emit(t, op == OP_CALL ? REG_CALL : REG_TAIL_CALL, operands[0],
+             (uint16_t)t->depth, 0, 0);
+        pushSlot(t);
+        break;
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+        materializeAll(t, t->depth);
+        t->depth -= operands[1] + 1;
+        emit(t, op == OP_INVOKE ? REG_INVOKE : REG_TAIL_INVOKE, operands[1],
+             (uint16_t)t->depth,
+             (uint16_t)((operands[2] << 8) | operands[3]), operands[0]);
+        pushSlot(t);
+        break;
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+        materializeAll(t, t->depth);
+        t->depth -= operands[1] + 2;
+        emit(t, op == OP_SUPER_INVOKE ? REG_SUPER_INVOKE
+                                      : REG_TAIL_SUPER_INVOKE,
+             operands[1], (uint16_t)t->depth,
+             (uint16_t)((operands[2] << 8) | operands[3]), operands[0]);
+        pushSlot(t);
+        break;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[operands[0]]);
+        // Captured locals must be in their slots. A function that captures
+        // itself refers to the slot its closure is about to be stored in.
+        for (int i = 0; i < function->upvalueCount; i++)
+        {
+            int index = operands[2 + 2 * i];
+            if (operands[1 + 2 * i] != CAPTURE_UPVALUE && index < t->depth)
+                materialize(t, index);
+        }
+        uint32_t upvalues = (uint32_t)(t->offset + 2);
+        emit(t, REG_CLOSURE, operands[0], (uint16_t)t->depth,
+             (uint16_t)upvalues, (uint16_t)(upvalues >> 16));
+        pushSlot(t);
+        break;
+    }
+    case OP_CLOSE_UPVALUE:
+        materialize(t, t->depth - 1);
+        emit(t, REG_CLOSE_UPVALUE, 0, (uint16_t)(t->depth - 1), 0, 0);
+        t->depth--;
+        break;
+    case OP_RETURN:
+        emit(t, REG_RETURN, 0, top(t, 0), 0, 0);
+        t->depth--;
+        t->live = false;
+        break;
+    case OP_CLASS:
+        emit(t, REG_CLASS, operands[0], (uint16_t)t->depth, 0, 0);
+        pushSlot(t);
+        break;
+    case OP_INHERIT:
+        emit(t, REG_INHERIT, 0, top(t, 1), top(t, 0), 0);
+        t->depth--;
+        break;
+    case OP_METHOD:
+        emit(t, REG_METHOD, operands[0], top(t, 1), top(t, 0), 0);
+        t->depth--;
+        break;
+    default:
+        break; // Quickened forms and superinstructions arrive as their base.
+    }
+}
+
+static RegCode *translate(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    RegCode *code = allocate(sizeof(RegCode));
+    code->code = NULL;
+    code->count = 0;
+    code->offsets = NULL;
+    code->frameSize = function->arity + 1;
+
+    code->constantCount = chunk->constants.count + 3;
+    code->constants = allocate(sizeof(Value) * code->constantCount);
+    for (int i = 0; i < chunk->constants.count; i++)
+        code->constants[i] = chunk->constants.values[i];
+    code->constants[chunk->constants.count] = NIL_VAL;
+    code->constants[chunk->constants.count + 1] = BOOL_VAL(true);
+    code->constants[chunk->constants.count + 2] = BOOL_VAL(false);
+
+    Translator t;
+    t.function = function;
+    t.chunk = chunk;
+    t.code = code;
+    t.capacity = 0;
+    // Every instruction pushes at most one entry.
+    t.stack = allocate(sizeof(uint16_t) * (function->arity + 1 + chunk->count));
+    t.depth = 0;
+    t.labels = allocate(sizeof(int) * (chunk->count + 1));
+    t.targetDepths = allocate(sizeof(int) * (chunk->count + 1));
+    t.fixups = NULL;
+    t.fixupCount = 0;
+    t.fixupCapacity = 0;
+    t.barrier = 0;
+    t.live = true;
+    for (int i = 0; i <= chunk->count; i++)
+        t.targetDepths[i] = -1;
+    for (int i = 0; i <= function->arity; i++)
+        push(&t, (uint16_t)i);
+
+    bool *targets = findTargets(chunk);
+    for (t.offset = 0; t.offset < chunk->count;
+         t.offset += instructionLength(chunk, t.offset))
+    {
+        if (targets[t.offset])
+            bindLabel(&t);
+        t.labels[t.offset] = code->count;
+        translateInstruction(&t, baseOpcode(chunk, t.offset));
+    }
+    t.labels[chunk->count] = code->count;
+
+    for (int i = 0; i < t.fixupCount; i++)
+    {
+        RegFixup *fixup = &t.fixups[i];
+        uint32_t target = (uint32_t)t.labels[fixup->target];
+        RegInstruction *instruction = &code->code[fixup->at];
+        if (fixup->wide)
+            instruction->b = (uint16_t)target;
+        instruction->c = (uint16_t)(fixup->wide ? target >> 16 : target);
+    }
+
+    free(targets);
+    free(t.stack);
+    free(t.labels);
+    free(t.targetDepths);
+    free(t.fixups);
+    return code;
+}
+
+RegCode *regcodeFor(ObjFunction *function)
+{
+    if (function->regcode == NULL)
+        function->regcode = translate(function);
+    return function->regcode;
+}
+
+void freeRegCode(RegCode *code)
+{
+    free(code->code);
+    free(code->offsets);
+    free(code->constants);
+    free(code);
+}
+
+int regcodeOffset(ObjFunction *function, uint8_t *ip)
+{
+    RegCode *code = function->regcode;
+    return code->offsets[(RegInstruction *)ip - code->code - 1];
+}
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "vm/jit.h"
+#include "vm/trace.h"
+
+int traceThreshold = -1;
+bool traceRecording = false;
+
+// The trace being recorded. Recording starts at the top of a hot loop and
+// follows the interpreter through calls and returns until the loop's own
+// back-edge is taken again in the frame it started in.
+typedef struct
+{
+    Trace *trace;
+    int frameCount; // vm.frameCount in the loop's frame.
+    TraceStep *steps;
+    int count;
+    int capacity;
+} Recorder;
+
+static Recorder recorder;
+
+static Trace *findTrace(Chunk *chunk, int header)
+{
+    for (Trace *trace = chunk->traces; trace != NULL; trace = trace->next)
+    {
+        if (trace->header == header)
+            return trace;
+    }
+
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (trace == NULL)
+        exit(1);
+    trace->header = header;
+    trace->next = chunk->traces;
+    chunk->traces = trace;
+    return trace;
+}
+
+Trace *traceLoop(CallFrame *frame)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    Trace *trace = findTrace(chunk, (int)(frame->ip - chunk->code));
+    if (trace->code != NULL)
+        return trace;
+    if (trace->hits < 0 || ++trace->hits < traceThreshold)
+        return NULL;
+
+    trace->hits = 0;
+    recorder.trace = trace;
+    recorder.frameCount = vm.frameCount;
+    recorder.count = 0;
+    traceRecording = true;
+    return NULL;
+}
+
+static void stopRecording(bool failed)
+{
+    Trace *trace = recorder.trace;
+    traceRecording = false;
+    recorder.trace = NULL;
+    if (failed && ++trace->aborts >= TRACE_MAX_ABORTS)
+        trace->hits = -1;
+}
+
+void traceAbort()
+{
+    if (traceRecording)
+        stopRecording(true);
+}
+
+static void addRef(Trace *trace, Obj *object)
+{
+    if (object == NULL)
+        return;
+    for (int i = 0; i < trace->refCount; i++)
+    {
+        if (trace->refs[i] == object)
+            return;
+    }
+    trace->refs[trace->refCount++] = object;
+}
+
+static void discardSteps(Trace *trace)
+{
+    free(trace->steps);
+    free(trace->refs);
+    trace->steps = NULL;
+    trace->stepCount = 0;
+    trace->refs = NULL;
+    trace->refCount = 0;
+}
+
+static void finishRecording()
+{
+    Trace *trace = recorder.trace;
+    trace->steps = malloc(sizeof(TraceStep) * recorder.count);
+    trace->refs = malloc(sizeof(Obj *) * 2 * recorder.count);
+    if (trace->steps == NULL || trace->refs == NULL)
+        exit(1);
+    for (int i = 0; i < recorder.count; i++)
+    {
+        trace->steps[i] = recorder.steps[i];
+        addRef(trace, (Obj *)recorder.steps[i].function);
+        addRef(trace, (Obj *)recorder.steps[i].shape);
+    }
+    trace->stepCount = recorder.count;
+
+    if (!jitCompileTrace(trace))
+    {
+        discardSteps(trace);
+        stopRecording(false);
+        trace->hits = -1;
+        return;
+    }
+    stopRecording(false);
+}
+
+static TraceStep *appendStep(ObjFunction *function, int offset, uint8_t op)
+{
+    if (recorder.capacity < recorder.count + 1)
+    {
+        recorder.capacity = recorder.capacity < 64 ? 64 : recorder.capacity * 2;
+        recorder.steps = realloc(recorder.steps,
+                                 sizeof(TraceStep) * recorder.capacity);
+        if (recorder.steps == NULL)
+            exit(1);
+    }
+
+    TraceStep *step = &recorder.steps[recorder.count++];
+    step->function = function;
+    step->offset = offset;
+    step->op = op;
+    step->taken = false;
+    step->shape = NULL;
+    step->slot = -1;
+    return step;
+}
+
+static bool takenBefore(ObjFunction *function, int offset)
+{
+    for (int i = 0; i < recorder.count; i++)
+    {
+        if (recorder.steps[i].op == OP_LOOP &&
+            recorder.steps[i].function == function &&
+            recorder.steps[i].offset == offset)
+            return true;
+    }
+    return false;
+}
+
+// Specializes a property access on receiver to its shape when it reads or
+// writes a field the receiver already has.
+static void observeProperty(TraceStep *step, Chunk *chunk, Value receiver)
+{
+    if (!IS_INSTANCE(receiver) || AS_INSTANCE(receiver)->shape == NULL)
+        return;
+
+    ObjShape *shape = AS_INSTANCE(receiver)->shape;
+    ObjString *name =
+        AS_STRING(chunk->constants.values[chunk->code[step->offset + 1]]);
+    int slot = shapeSlot(shape, name);
+    if (slot >= 0)
+    {
+        step->shape = shape;
+        step->slot = slot;
+    }
+}
+
+uint8_t traceRecord(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    Chunk *chunk = &function->chunk;
+    int offset = (int)(frame->ip - chunk->code);
+    uint8_t op = baseOpcode(chunk, offset);
+    frame->ip++;
+
+    // Returning from the loop's frame, or replacing it with a tail call,
+    // leaves the loop.
+    int depth = vm.frameCount - recorder.frameCount;
+    if (depth < 0 || recorder.count == TRACE_MAX_STEPS || !jitSupports(op) ||
+        (depth == 0 && (op == OP_RETURN || op == OP_TAIL_CALL ||
+                        op == OP_TAIL_INVOKE || op == OP_TAIL_SUPER_INVOKE)))
+    {
+        stopRecording(true);
+        return op;
+    }
+
+    if (op == OP_LOOP)
+    {
+        int target = offset + 3 - ((chunk->code[offset + 1] << 8) |
+                                   chunk->code[offset + 2]);
+        if (depth == 0 && target == recorder.trace->header)
+        {
+            appendStep(function, offset, op);
+            finishRecording();
+            return op;
+        }
+        // A for loop's body jumps back to its increment clause, which jumps
+        // back to the condition, so one iteration can take several
+        // back-edges. Taking the same one twice means an inner loop, which
+        // gets a trace of its own.
+        if (takenBefore(function, offset))
+        {
+            stopRecording(true);
+            return op;
+        }
+    }
+
+    TraceStep *step = appendStep(function, offset, op);
+    switch (op)
+    {
+    case OP_JUMP_IF_FALSE:
+        step->taken = jitPeekFalsey();
+        break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+        step->taken = IS_NUMBER(vm.stackTop[-1]) && IS_NUMBER(vm.stackTop[-2]);
+        break;
+    case OP_GET_PROPERTY:
+        observeProperty(step, chunk, vm.stackTop[-1]);
+        break;
+    case OP_SET_PROPERTY:
+        observeProperty(step, chunk, vm.stackTop[-2]);
+        break;
+    default:
+        break;
+    }
+    return op;
+}
+
+InterpretResult traceRun(Trace *trace, CallFrame *frame)
+{
+    trace->entries++;
+    InterpretResult result = jitRunTrace(trace, frame);
+
+    // A trace that keeps leaving before the end of its first iteration costs
+    // more than it saves.
+    if (trace->entries >= TRACE_MIN_ENTRIES &&
+        trace->iterations < trace->entries)
+    {
+        jitFreeTrace(trace);
+        discardSteps(trace);
+        trace->hits = -1;
+    }
+    return result;
+}
+
+// Compiled traces compare against the functions and shapes they were
+// recorded with, so those must not be collected and their memory reused.
+void markTraces(Trace *trace)
+{
+    for (; trace != NULL; trace = trace->next)
+    {
+        for (int i = 0; i < trace->refCount; i++)
+            markObject(trace->refs[i]);
+    }
+}
+
+void markTraceRecorder()
+{
+    if (!traceRecording)
+        return;
+    for (int i = 0; i < recorder.count; i++)
+    {
+        markObject((Obj *)recorder.steps[i].function);
+        markObject((Obj *)recorder.steps[i].shape);
+    }
+}
+
+void freeTraces(Trace *trace)
+{
+    while (trace != NULL)
+    {
+        Trace *next = trace->next;
+        if (trace->code != NULL)
+            jitFreeTrace(trace);
+        discardSteps(trace);
+        free(trace);
+        trace = next;
+    }
+}
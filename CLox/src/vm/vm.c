@@ -1,20 +1,40 @@
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
+#include <unistd.h>
 #include "common.h"
 #include "compiler/compiler.h"
 #include "disassembler/debug.h"
+#include "disassembler/profile.h"
 #include "memory.h"
+#include "vm/jit.h"
 #include "vm/object.h"
+#include "vm/regcode.h"
+#include "vm/trace.h"
 #include "vm/vm.h"
 #include "value.h"
 
 VM vm;
+int maxFrames = FRAMES_MAX;
 
-static Value clockNative(int argCount, Value *args)
+static bool clockNative(NativeContext *context, int argCount, Value *args,
+                        Value *result)
 {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+static bool sqrtNative(NativeContext *context, int argCount, Value *args,
+                       Value *result)
+{
+    if (!IS_NUMBER(args[0]))
+        return nativeError(context, "Argument to sqrt() must be a number.");
+    *result = NUMBER_VAL(sqrt(AS_NUMBER(args[0])));
+    return true;
 }
 
 static void resetStack()
@@ -26,17 +46,21 @@ static void resetStack()
 
 void runtimeError(const char *format, ...)
 {
+    flushOutput();
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
+    traceAbort();
 
     for (int i = vm.frameCount - 1; i >= 0; i--)
     {
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
+        size_t instruction = registerVM
+                                 ? regcodeOffset(function, frame->ip)
+                                 : frame->ip - function->chunk.code - 1;
         LineInfo lineInfo = getLineInfo(&function->chunk, instruction);
         fprintf(stderr, "[line %d:%d] in ",
                 lineInfo.line, lineInfo.column);
@@ -53,40 +77,131 @@ void runtimeError(const char *format, ...)
     resetStack();
 }
 
-static void defineNative(const char *name, NativeFn function)
+int globalSlot(ObjString *name)
+{
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot))
+    {
+        return (int)AS_NUMBER(slot);
+    }
+
+    push(OBJ_VAL(name));
+    int index = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    pop();
+    return index;
+}
+
+static void defineNative(const char *name, int arity, NativeFn function)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(function, arity)));
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
 
-void initVM()
+// Reserves size bytes of address space, rounded up to whole pages, with an
+// inaccessible page after them. Pages are backed on first touch.
+static void *reserve(size_t size, size_t *mapped)
 {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+    uint8_t *base = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        fprintf(stderr, "Could not reserve the VM stack.\n");
+        exit(1);
+    }
+    mprotect(base + size, page, PROT_NONE);
+    *mapped = size + page;
+    return base;
+}
 
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+static size_t framesMapped;
+static size_t stackMapped;
+static size_t frameClosuresMapped;
 
+void initVM()
+{
+    vm.frames = reserve(sizeof(CallFrame) * (size_t)maxFrames, &framesMapped);
+    vm.stack = reserve(sizeof(Value) * (size_t)maxFrames * UINT8_COUNT,
+                       &stackMapped);
+    vm.stackLimit = vm.stack + (size_t)maxFrames * UINT8_COUNT;
+    vm.frameClosures = reserve((size_t)FRAME_CLOSURES_MAX * maxFrames,
+                               &frameClosuresMapped);
+    resetStack();
+    // Output to a pipe or file goes through a buffer of the VM's own, which
+    // is larger than the one stdio picks.
+    if (!isatty(fileno(stdout)))
+        setvbuf(stdout, vm.output, _IOFBF, sizeof(vm.output));
+    // Set up the collector first: copyString() below allocates.
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
+    vm.oldBytes = 0;
+    vm.nextMajorGC = vm.nextGC;
+    memset(vm.allocations, 0, sizeof(vm.allocations));
+    vm.collections = 0;
+    vm.minorCollections = 0;
+    vm.incrementalSteps = 0;
+    vm.sweepSteps = 0;
+    vm.gcSeconds = 0;
+    vm.longestPause = 0;
 
     vm.grayCount = 0;
     vm.grayCapacity = 0;
     vm.grayStack = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.remembered = NULL;
+    vm.loggedCount = 0;
+    vm.loggedCapacity = 0;
+    vm.logged = NULL;
+    vm.deferredCount = 0;
+    vm.deferredCapacity = 0;
+    vm.deferred = NULL;
+    vm.regionCount = 0;
+    vm.regionCapacity = 0;
+    vm.regions = NULL;
+    vm.regionObjects = 0;
+
+    vm.objects = NULL;
+    vm.oldObjects = NULL;
+    vm.unswept = NULL;
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalNames);
+    initValueArray(&vm.globalValues);
+    initTable(&vm.strings);
+
+    vm.initString = NULL;
+    vm.initString = copyString("init", 4);
+    vm.methodEpoch = 0;
 
-    defineNative("clock", clockNative);
+    defineNative("clock", 0, clockNative);
+    defineNative("sqrt", 1, sqrtNative);
 }
 
 void freeVM()
 {
+    flushOutput();
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalNames);
+    freeValueArray(&vm.globalValues);
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    munmap(vm.frames, framesMapped);
+    munmap(vm.stack, stackMapped);
+    munmap(vm.frameClosures, frameClosuresMapped);
+}
+
+void flushOutput()
+{
+    fflush(stdout);
 }
 
 void push(Value value)
@@ -106,6 +221,48 @@ static Value peek(int distance)
     return vm.stackTop[-1 - distance];
 }
 
+// A native's arguments sit on top of the stack while it runs, so whatever it
+// pushes above them is marked by the GC and dropped when it returns.
+Value nativeRoot(NativeContext *context, Value value)
+{
+    push(value);
+    return value;
+}
+
+bool nativeError(NativeContext *context, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(context->error, sizeof(context->error), format, args);
+    va_end(args);
+    return false;
+}
+
+// Calls native with the argCount arguments on top of the stack. Its result
+// replaces the callee and the arguments without going through push().
+static inline bool callNative(ObjNative *native, int argCount)
+{
+    if (native->arity >= 0 && argCount != native->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.",
+                     native->arity, argCount);
+        return false;
+    }
+
+    NativeContext context;
+    context.error[0] = '\0';
+    Value *args = vm.stackTop - argCount;
+    Value result;
+    if (!native->function(&context, argCount, args, &result))
+    {
+        runtimeError("%s", context.error);
+        return false;
+    }
+    args[-1] = result;
+    vm.stackTop = args;
+    return true;
+}
+
 static bool call(ObjClosure *closure, int argCount)
 {
     if (argCount != closure->function->arity)
@@ -115,12 +272,19 @@ static bool call(ObjClosure *closure, int argCount)
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX)
+    if (vm.frameCount == maxFrames)
     {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    ObjFunction *function = closure->function;
+    if (function->jit == NULL && jitThreshold >= 0 &&
+        function->callCount >= 0 && function->callCount++ >= jitThreshold)
+    {
+        jitCompile(function);
+    }
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
@@ -144,11 +308,9 @@ static bool callValue(Value callee, int argCount)
         {
             ObjClass *klass = AS_CLASS(callee);
             vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
-            Value initializer;
-            if (tableGet(&klass->methods, vm.initString,
-                         &initializer))
+            if (klass->initializer != NULL)
             {
-                return call(AS_CLOSURE(initializer), argCount);
+                return call(klass->initializer, argCount);
             }
             else if (argCount != 0)
             {
@@ -162,13 +324,7 @@ static bool callValue(Value callee, int argCount)
         case OBJ_CLOSURE:
             return call(AS_CLOSURE(callee), argCount);
         case OBJ_NATIVE:
-        {
-            NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            push(result);
-            return true;
-        }
+            return callNative(AS_NATIVE(callee), argCount);
         default:
             break; // Non-callable object type.
         }
@@ -177,52 +333,142 @@ static bool callValue(Value callee, int argCount)
     return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name,
-                            int argCount)
+// Looks name up in klass's methods. When key is not NULL the result is
+// remembered in cache under key, and a later lookup with the same key is
+// answered from the cache until the next OP_METHOD/OP_INHERIT.
+static ObjClosure *findMethod(ObjClass *klass, ObjString *name, Obj *key,
+                              MethodCache *cache)
 {
+    if (key != NULL && cache->key == key &&
+        cache->epoch == vm.methodEpoch)
+    {
+        return cache->method;
+    }
+
     Value method;
     if (!tableGet(&klass->methods, name, &method))
+    {
+        return NULL;
+    }
+
+    if (key != NULL)
+    {
+        cache->key = key;
+        cache->method = AS_CLOSURE(method);
+        cache->epoch = vm.methodEpoch;
+    }
+    return AS_CLOSURE(method);
+}
+
+static bool invokeFromClass(ObjClass *klass, ObjString *name,
+                            int argCount, Obj *key, MethodCache *cache)
+{
+    ObjClosure *method = findMethod(klass, name, key, cache);
+    if (method == NULL)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    return call(method, argCount);
 }
 
-static bool invoke(ObjString *name, int argCount)
+static bool invoke(ObjString *name, int argCount, MethodCache *cache)
 {
     Value receiver = peek(argCount);
     if (!IS_INSTANCE(receiver))
     {
-        runtimeError("Only instances have methods.");
+        runtimeError(cache->readsProperty ? "Only instances have properties."
+                                          : "Only instances have methods.");
         return false;
     }
     ObjInstance *instance = AS_INSTANCE(receiver);
+    // A shape-keyed hit also proves no field shadows the method, so the
+    // field lookup below can be skipped.
+    if (instance->shape != NULL && cache->key == (Obj *)instance->shape &&
+        cache->epoch == vm.methodEpoch)
+    {
+        return call(cache->method, argCount);
+    }
+
     Value value;
-    if (tableGet(&instance->fields, name, &value))
+    if (instanceGetField(instance, name, &value))
     {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
-    return invokeFromClass(instance->klass, name, argCount);
+    return invokeFromClass(instance->klass, name, argCount,
+                           (Obj *)instance->shape, cache);
 }
 
-static bool bindMethod(ObjClass *klass, ObjString *name)
+// Stores klass's method name, bound to receiver, in *result. The receiver
+// must stay reachable until then.
+static bool bindMethod(ObjClass *klass, ObjString *name, MethodCache *cache,
+                       Value receiver, Value *result)
 {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method))
+    ObjClosure *method = findMethod(klass, name,
+                                    cache == NULL ? NULL : (Obj *)klass,
+                                    cache);
+    if (method == NULL)
     {
         runtimeError("Undefined property '%s'.", name->chars);
         return false;
     }
 
-    ObjBoundMethod *bound = newBoundMethod(peek(0),
-                                           AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    *result = OBJ_VAL(newBoundMethod(receiver, method));
     return true;
 }
 
+static inline PropertyCacheEntry *findPropertyCache(PropertyCache *cache,
+                                                     ObjShape *shape)
+{
+    for (int i = 0; i < PROPERTY_CACHE_WAYS; i++)
+    {
+        if (cache->entries[i].shape == shape)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static void updatePropertyCache(PropertyCache *cache, ObjShape *shape,
+                                ObjShape *transition, int slot)
+{
+    PropertyCacheEntry *entry = &cache->entries[cache->next];
+    cache->next = (cache->next + 1) % PROPERTY_CACHE_WAYS;
+    entry->shape = shape;
+    entry->transition = transition;
+    entry->slot = slot;
+}
+
+// Rewrites the one-byte instruction just executed in frame to `op`. The
+// chunk's original bytes are copied aside the first time this happens so the
+// instruction can be reverted and the disassembler can show both forms.
+static void quicken(CallFrame *frame, OpCode op)
+{
+    // The opcode profile counts the generic instructions the compiler emits.
+    // While recording a trace, superinstructions run one component at a
+    // time through the generic handlers, which must not overwrite them.
+    if (profileOps || traceRecording)
+        return;
+
+    Chunk *chunk = &frame->closure->function->chunk;
+    if (chunk->original == NULL)
+    {
+        uint8_t *original = ALLOCATE(uint8_t, chunk->count);
+        memcpy(original, chunk->code, chunk->count);
+        chunk->original = original;
+    }
+    frame->ip[-1] = op;
+}
+
+// Restores the quickened instruction just executed in frame to its original
+// form and rewinds ip so it runs again through the generic handler.
+static void dequicken(CallFrame *frame)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    frame->ip--;
+    *frame->ip = chunk->original[frame->ip - chunk->code];
+}
+
 static ObjUpvalue *captureUpvalue(Value *local)
 {
     ObjUpvalue *prevUpvalue = NULL;
@@ -261,16 +507,136 @@ static void closeUpvalues(Value *last)
         ObjUpvalue *upvalue = vm.openUpvalues;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj *)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
 
-static void defineMethod(ObjString *name)
+static inline void setUpvalue(ObjUpvalue *upvalue, Value value)
+{
+    snapshotBarrier(*upvalue->location);
+    *upvalue->location = value;
+    writeBarrier((Obj *)upvalue, value);
+}
+
+// Makes a closure of function in frame's own storage instead of the heap.
+// The compiler only sends functions here whose closures are called where
+// they are declared and are never read as values or captured, so none
+// outlives the frame. They are born marked and are never on vm.objects:
+// the collector neither traces nor sweeps them, and what they reference is
+// reachable from the frame anyway.
+static ObjClosure *newFrameClosure(CallFrame *frame, ObjFunction *function)
+{
+    ObjClosure *closure =
+        (ObjClosure *)(vm.frameClosures +
+                       (size_t)(frame - vm.frames) * FRAME_CLOSURES_MAX +
+                       function->frameOffset);
+    closure->obj.type = OBJ_CLOSURE;
+    closure->obj.isMarked = true;
+    closure->obj.isOld = false;
+    closure->obj.isRemembered = false;
+    closure->obj.next = NULL;
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
+    closure->cellCount = function->upvalueCount;
+    return closure;
+}
+
+static inline ObjClosure *makeClosure(CallFrame *frame, ObjFunction *function)
+{
+    return function->frameOffset >= 0 ? newFrameClosure(frame, function)
+                                      : newClosure(function);
+}
+
+// Sets up one of the upvalues a closure holds itself, closed over value.
+static inline ObjUpvalue *newCell(ObjUpvalue *cell, Value value)
+{
+    cell->obj.type = OBJ_UPVALUE;
+    cell->obj.isMarked = true;
+    cell->obj.isOld = false;
+    cell->obj.isRemembered = false;
+    cell->obj.next = NULL;
+    cell->closed = value;
+    cell->location = &cell->closed;
+    cell->next = NULL;
+    return cell;
+}
+
+// Fills in the upvalues of a closure just made in frame, from the capture
+// kind and index pairs that follow OP_CLOSURE.
+static void captureUpvalues(CallFrame *frame, ObjClosure *closure,
+                            const uint8_t *operands)
+{
+    ObjClosure *enclosing = frame->closure;
+    ObjUpvalue *cells = closureCells(closure);
+    int cellCount = 0;
+    for (int i = 0; i < closure->upvalueCount; i++)
+    {
+        uint8_t capture = operands[2 * i];
+        uint8_t index = operands[2 * i + 1];
+        ObjUpvalue *upvalue;
+        if (capture == CAPTURE_UPVALUE)
+        {
+            upvalue = enclosing->upvalues[index];
+            // The enclosing closure's own copy goes when it does.
+            if (isClosureCell(enclosing, upvalue))
+                upvalue = newCell(&cells[cellCount++], *upvalue->location);
+        }
+        else if (capture == CAPTURE_VALUE)
+        {
+            upvalue = newCell(&cells[cellCount++], frame->slots[index]);
+        }
+        else if (closure->function->frameOffset >= 0)
+        {
+            // A closure made in the frame cannot outlive the locals it
+            // captures, so it points at them for good instead of joining
+            // the open list.
+            upvalue = newCell(&cells[cellCount++], NIL_VAL);
+            upvalue->location = frame->slots + index;
+        }
+        else
+        {
+            upvalue = captureUpvalue(frame->slots + index);
+        }
+        closure->upvalues[i] = upvalue;
+        // Capturing may have collected, promoting the closure.
+        writeBarrier((Obj *)closure, OBJ_VAL(upvalue));
+        writeBarrier((Obj *)closure, upvalue->closed);
+    }
+}
+
+// Moves the frame a tail call has just pushed down into its caller's place,
+// so the callee returns straight to the caller's caller.
+static void replaceCaller()
+{
+    CallFrame *caller = &vm.frames[vm.frameCount - 2];
+    CallFrame *callee = &vm.frames[vm.frameCount - 1];
+    // A closure made in the caller's frame lives there, and points at its
+    // locals: the call goes ahead as an ordinary one.
+    if (callee->closure->function->frameOffset >= 0)
+        return;
+    closeUpvalues(caller->slots);
+    size_t count = (size_t)(vm.stackTop - callee->slots);
+    memmove(caller->slots, callee->slots, sizeof(Value) * count);
+    vm.stackTop = caller->slots + count;
+    caller->closure = callee->closure;
+    caller->ip = callee->ip;
+    vm.frameCount--;
+}
+
+static void defineMethod(ObjClass *klass, ObjString *name, Value method)
 {
-    Value method = peek(0);
-    ObjClass *klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
-    pop();
+    if (name == vm.initString)
+        klass->initializer = AS_CLOSURE(method);
+    vm.methodEpoch++;
+}
+
+static void inheritMethods(ObjClass *superclass, ObjClass *subclass)
+{
+    tableAddAll(&superclass->methods, &subclass->methods);
+    subclass->initializer = superclass->initializer;
+    vm.methodEpoch++;
 }
 
 bool isFalsey(Value value)
@@ -278,21 +644,151 @@ bool isFalsey(Value value)
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate()
+// Short results are copied as they are made. Longer ones are ropes, so
+// building a string piece by piece does not copy it each time. Neither is
+// interned unless it is compared.
+static ObjString *concatenate(ObjString *a, ObjString *b)
 {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-
+    if (a->length == 0)
+        return b;
+    if (b->length == 0)
+        return a;
     int length = a->length + b->length;
+    if (length >= ROPE_MIN_LENGTH)
+        return newRope(a, b);
+
+    // Only long strings are ropes, so this does not allocate.
+    const char *aChars = stringChars(a);
+    const char *bChars = stringChars(b);
     char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
+    memcpy(chars, aChars, a->length);
+    memcpy(chars + a->length, bChars, b->length);
     chars[length] = '\0';
 
-    ObjString *result = takeString(chars, length);
-    pop();
+    return newString(chars, length);
+}
+
+// Reads property name of receiver into *result, which may be where the
+// receiver is kept.
+static inline bool loadProperty(Value receiver, ObjString *name,
+                                PropertyCache *cache, Value *result)
+{
+    if (!IS_INSTANCE(receiver))
+    {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjShape *shape = instance->shape;
+    PropertyCacheEntry *entry =
+        shape == NULL ? NULL : findPropertyCache(cache, shape);
+    if (entry != NULL)
+    {
+        *result = instance->slots[entry->slot];
+        return true;
+    }
+
+    if (instanceGetField(instance, name, result))
+    {
+        if (shape != NULL)
+        {
+            updatePropertyCache(cache, shape, NULL, shapeSlot(shape, name));
+        }
+        return true;
+    }
+
+    return bindMethod(instance->klass, name, NULL, receiver, result);
+}
+
+static inline bool storeProperty(Value receiver, ObjString *name,
+                                 PropertyCache *cache, Value value)
+{
+    if (!IS_INSTANCE(receiver))
+    {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(receiver);
+    ObjShape *shape = instance->shape;
+    PropertyCacheEntry *entry =
+        shape == NULL ? NULL : findPropertyCache(cache, shape);
+    if (entry != NULL && entry->transition == NULL)
+    {
+        snapshotBarrier(instance->slots[entry->slot]);
+        instance->slots[entry->slot] = value;
+        writeBarrier((Obj *)instance, value);
+    }
+    else if (entry != NULL)
+    {
+        instanceAppendSlot(instance, entry->transition, value);
+    }
+    else
+    {
+        instanceSetField(instance, name, value);
+        if (shape != NULL && instance->shape == shape)
+        {
+            updatePropertyCache(cache, shape, NULL, shapeSlot(shape, name));
+        }
+        else if (shape != NULL && instance->shape != NULL)
+        {
+            updatePropertyCache(cache, shape, instance->shape,
+                                instance->shape->slotCount - 1);
+        }
+    }
+    return true;
+}
+
+static bool getProperty(CallFrame *frame)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    ObjString *name = AS_STRING(chunk->constants.values[frame->ip[0]]);
+    PropertyCache *cache =
+        &chunk->propertyCaches[(frame->ip[1] << 8) | frame->ip[2]];
+    if (!loadProperty(peek(0), name, cache, &vm.stackTop[-1]))
+        return false;
+    frame->ip += 3;
+    return true;
+}
+
+static bool setProperty(CallFrame *frame)
+{
+    Chunk *chunk = &frame->closure->function->chunk;
+    ObjString *name = AS_STRING(chunk->constants.values[frame->ip[0]]);
+    PropertyCache *cache =
+        &chunk->propertyCaches[(frame->ip[1] << 8) | frame->ip[2]];
+    if (!storeProperty(peek(1), name, cache, peek(0)))
+        return false;
+    frame->ip += 3;
+    Value value = pop();
     pop();
-    push(OBJ_VAL(result));
+    push(value);
+    return true;
+}
+
+static bool add()
+{
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+    {
+        ObjString *result =
+            concatenate(AS_STRING(peek(1)), AS_STRING(peek(0)));
+        pop();
+        pop();
+        push(OBJ_VAL(result));
+    }
+    else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+    {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    }
+    else
+    {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
 }
 
 static InterpretResult run()
@@ -303,6 +799,13 @@ static InterpretResult run()
 #define READ_STRING(idx) AS_STRING(READ_CONSTANT(idx))
 #define READ_SHORT() \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG()                                         \
+    (frame->ip += 3, (uint32_t)((frame->ip[-3] << 16) |     \
+                                (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_PROPERTY_CACHE() \
+    (&frame->closure->function->chunk.propertyCaches[READ_SHORT()])
+#define READ_METHOD_CACHE() \
+    (&frame->closure->function->chunk.methodCaches[READ_SHORT()])
 #define BINARY_OP(valueType, op)                        \
     do                                                  \
     {                                                   \
@@ -315,373 +818,1221 @@ static InterpretResult run()
         double a = AS_NUMBER(pop());                    \
         push(valueType(a op b));                        \
     } while (false)
+// Quickened form of BINARY_OP. The guard failing is not an error here: the
+// instruction is rewritten back to its generic form and executed again.
+#define NUMBER_OP(valueType, op)                        \
+    do                                                  \
+    {                                                   \
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+        {                                               \
+            dequicken(frame);                           \
+            DISPATCH();                                 \
+        }                                               \
+        double b = AS_NUMBER(pop());                    \
+        double a = AS_NUMBER(pop());                    \
+        push(valueType(a op b));                        \
+    } while (false)
+
+#define CHECK(ok)                               \
+    do                                          \
+    {                                           \
+        if (!(ok))                              \
+            return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+#define GET_GLOBAL(index)                                            \
+    do                                                               \
+    {                                                                \
+        uint32_t slot = (index);                                     \
+        Value value = vm.globalValues.values[slot];                  \
+        if (IS_UNDEFINED(value))                                     \
+        {                                                            \
+            runtimeError("Undefined variable '%s'.",                 \
+                         AS_CSTRING(vm.globalNames.values[slot]));   \
+            return INTERPRET_RUNTIME_ERROR;                          \
+        }                                                            \
+        push(value);                                                 \
+    } while (false)
+#define SET_GLOBAL(index)                                            \
+    do                                                               \
+    {                                                                \
+        uint32_t slot = (index);                                     \
+        if (IS_UNDEFINED(vm.globalValues.values[slot]))              \
+        {                                                            \
+            runtimeError("Undefined variable '%s'.",                 \
+                         AS_CSTRING(vm.globalNames.values[slot]));   \
+            return INTERPRET_RUNTIME_ERROR;                          \
+        }                                                            \
+        vm.globalValues.values[slot] = peek(0);                      \
+    } while (false)
+#define DEFINE_GLOBAL(index)                                         \
+    do                                                               \
+    {                                                                \
+        vm.globalValues.values[(index)] = peek(0);                   \
+        pop();                                                       \
+    } while (false)
+
+// Bodies of the instructions that may take part in a superinstruction. The
+// plain handlers below and the fused handlers generated from
+// superinstructions.h share them. Each body expects frame->ip to point just
+// past its own opcode byte. Only the last instruction of a superinstruction
+// may change frame or ip beyond its operands.
+#define DO_OP_CONSTANT() push(READ_CONSTANT(READ_BYTE()))
+#define DO_OP_NIL() push(NIL_VAL)
+#define DO_OP_TRUE() push(BOOL_VAL(true))
+#define DO_OP_FALSE() push(BOOL_VAL(false))
+#define DO_OP_POP() pop()
+#define DO_OP_GET_LOCAL() push(frame->slots[READ_BYTE()])
+#define DO_OP_SET_LOCAL() (frame->slots[READ_BYTE()] = peek(0))
+#define DO_OP_GET_GLOBAL() GET_GLOBAL(READ_BYTE())
+#define DO_OP_SET_GLOBAL() SET_GLOBAL(READ_BYTE())
+#define DO_OP_GET_UPVALUE() \
+    push(*frame->closure->upvalues[READ_BYTE()]->location)
+#define DO_OP_SET_UPVALUE() \
+    setUpvalue(frame->closure->upvalues[READ_BYTE()], peek(0))
+#define DO_OP_GET_PROPERTY() CHECK(getProperty(frame))
+#define DO_OP_SET_PROPERTY() CHECK(setProperty(frame))
+// The operands stay on the stack while comparing, as interning a string may
+// collect.
+#define DO_OP_EQUAL()                                   \
+    do                                                  \
+    {                                                   \
+        bool equal = valuesEqual(peek(1), peek(0));     \
+        pop();                                          \
+        pop();                                          \
+        push(BOOL_VAL(equal));                          \
+    } while (false)
+#define DO_OP_GREATER() BINARY_OP(BOOL_VAL, >)
+#define DO_OP_LESS() BINARY_OP(BOOL_VAL, <)
+#define DO_OP_ADD() CHECK(add())
+#define DO_OP_SUBTRACT() BINARY_OP(NUMBER_VAL, -)
+#define DO_OP_MULTIPLY() BINARY_OP(NUMBER_VAL, *)
+#define DO_OP_DIVIDE() BINARY_OP(NUMBER_VAL, /)
+#define DO_OP_NOT() push(BOOL_VAL(isFalsey(pop())))
+#define DO_OP_NEGATE()                                  \
+    do                                                  \
+    {                                                   \
+        if (!IS_NUMBER(peek(0)))                        \
+        {                                               \
+            runtimeError("Operand must be a number.");  \
+            return INTERPRET_RUNTIME_ERROR;             \
+        }                                               \
+        push(NUMBER_VAL(-AS_NUMBER(pop())));            \
+    } while (false)
+#define DO_OP_JUMP_IF_FALSE()                   \
+    do                                          \
+    {                                           \
+        uint16_t offset = READ_SHORT();         \
+        if (isFalsey(peek(0)))                  \
+            frame->ip += offset;                \
+    } while (false)
+#define DO_OP_JUMP()                            \
+    do                                          \
+    {                                           \
+        uint16_t offset = READ_SHORT();         \
+        frame->ip += offset;                    \
+    } while (false)
+#define DO_OP_LOOP()                            \
+    do                                          \
+    {                                           \
+        uint16_t offset = READ_SHORT();         \
+        frame->ip -= offset;                    \
+    } while (false)
+// Natives skip callValue(): they push no frame, so frame stays put.
+#define DO_OP_CALL()                                            \
+    do                                                          \
+    {                                                           \
+        int argCount = READ_BYTE();                             \
+        Value callee = peek(argCount);                          \
+        if (IS_NATIVE(callee))                                  \
+        {                                                       \
+            CHECK(callNative(AS_NATIVE(callee), argCount));     \
+            break;                                              \
+        }                                                       \
+        CHECK(callValue(callee, argCount));                     \
+        frame = &vm.frames[vm.frameCount - 1];                  \
+    } while (false)
+#define DO_OP_INVOKE()                                  \
+    do                                                  \
+    {                                                   \
+        ObjString *method = READ_STRING(READ_BYTE());   \
+        int argCount = READ_BYTE();                     \
+        MethodCache *cache = READ_METHOD_CACHE();       \
+        CHECK(invoke(method, argCount, cache));         \
+        frame = &vm.frames[vm.frameCount - 1];          \
+    } while (false)
+#define DO_OP_GET_SUPER()                                       \
+    do                                                          \
+    {                                                           \
+        ObjString *name = READ_STRING(READ_BYTE());             \
+        MethodCache *cache = READ_METHOD_CACHE();               \
+        ObjClass *superclass = AS_CLASS(pop());                 \
+        CHECK(bindMethod(superclass, name, cache, peek(0),      \
+                         &vm.stackTop[-1]));                    \
+    } while (false)
+#define DO_OP_SUPER_INVOKE()                                    \
+    do                                                          \
+    {                                                           \
+        ObjString *method = READ_STRING(READ_BYTE());           \
+        int argCount = READ_BYTE();                             \
+        MethodCache *cache = READ_METHOD_CACHE();               \
+        ObjClass *superclass = AS_CLASS(pop());                 \
+        CHECK(invokeFromClass(superclass, method, argCount,     \
+                              (Obj *)superclass, cache));       \
+        frame = &vm.frames[vm.frameCount - 1];                  \
+    } while (false)
+// Runs call, one of the call instructions above, as a tail call. Natives and
+// classes without an initializer push no frame and leave their result for
+// the OP_RETURN that follows.
+#define TAIL_CALL(call)                                 \
+    do                                                  \
+    {                                                   \
+        int callerCount = vm.frameCount;                \
+        call;                                           \
+        if (vm.frameCount > callerCount)                \
+        {                                               \
+            replaceCaller();                            \
+            frame = &vm.frames[vm.frameCount - 1];      \
+        }                                               \
+    } while (false)
+#define DO_OP_TAIL_CALL() TAIL_CALL(DO_OP_CALL())
+#define DO_OP_TAIL_INVOKE() TAIL_CALL(DO_OP_INVOKE())
+#define DO_OP_TAIL_SUPER_INVOKE() TAIL_CALL(DO_OP_SUPER_INVOKE())
+#define DO_OP_CLOSURE()                                                 \
+    do                                                                  \
+    {                                                                   \
+        ObjFunction *function = AS_FUNCTION(READ_CONSTANT(READ_BYTE())); \
+        ObjClosure *closure = makeClosure(frame, function);             \
+        push(OBJ_VAL(closure));                                         \
+        captureUpvalues(frame, closure, frame->ip);                     \
+        frame->ip += 2 * closure->upvalueCount;                         \
+    } while (false)
+#define DO_OP_CLOSE_UPVALUE()                   \
+    do                                          \
+    {                                           \
+        closeUpvalues(vm.stackTop - 1);         \
+        pop();                                  \
+    } while (false)
+#define DO_OP_PRINT()                           \
+    do                                          \
+    {                                           \
+        printValue(pop());                      \
+        putchar('\n');                          \
+    } while (false)
+#define DO_OP_RETURN()                                  \
+    do                                                  \
+    {                                                   \
+        Value result = pop();                           \
+        closeUpvalues(frame->slots);                    \
+        vm.frameCount--;                                \
+        if (vm.frameCount == 0)                         \
+        {                                               \
+            pop();                                      \
+            return INTERPRET_OK;                        \
+        }                                               \
+                                                        \
+        vm.stackTop = frame->slots;                     \
+        push(result);                                   \
+        frame = &vm.frames[vm.frameCount - 1];          \
+    } while (false)
+
+// Runs frame, and whichever frames it leaves on top, as native code for as
+// long as their functions have been compiled. Native code returns whenever
+// it calls or returns, with frame->ip saved like the interpreter does.
+// Nothing runs natively while a trace is being recorded.
+#define JIT_ENTER()                                         \
+    do                                                      \
+    {                                                       \
+        void *entry;                                        \
+        while (!traceRecording &&                           \
+               (entry = jitEntry(frame)) != NULL)           \
+        {                                                   \
+            if (jitRun(frame, entry) != INTERPRET_OK)       \
+                return INTERPRET_RUNTIME_ERROR;             \
+            if (vm.frameCount == 0)                         \
+                return INTERPRET_OK;                        \
+            frame = &vm.frames[vm.frameCount - 1];          \
+        }                                                   \
+    } while (false)
+
+// Counts the back-edge just taken and runs the loop's trace once it has
+// one. The trace returns at a side exit, possibly in another frame.
+#define TRACE_LOOP()                                                \
+    do                                                              \
+    {                                                               \
+        if (traceThreshold >= 0 && !traceRecording)                 \
+        {                                                           \
+            Trace *trace = traceLoop(frame);                        \
+            if (trace != NULL)                                      \
+            {                                                       \
+                if (traceRun(trace, frame) != INTERPRET_OK)         \
+                    return INTERPRET_RUNTIME_ERROR;                 \
+                frame = &vm.frames[vm.frameCount - 1];              \
+                JIT_ENTER();                                        \
+            }                                                       \
+            else if (traceRecording)                                \
+            {                                                       \
+                START_RECORDING();                                  \
+            }                                                       \
+        }                                                           \
+    } while (false)
 
-    for (;;)
-    {
 #ifdef DEBUG_TRACE_EXECUTION
-        if (debug){
-            printf("          ");
-            for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-            {
-                printf("[ ");
-                printValue(*slot);
-                printf(" ]");
-            }
-            printf("\n");
-            disassembleInstruction(&frame->closure->function->chunk,
-                                (int)(frame->ip - frame->closure->function->chunk.code));
-        }
+#define TRACE_EXECUTION()                                                         \
+    do                                                                            \
+    {                                                                             \
+        if (debug)                                                                \
+        {                                                                         \
+            printf("          ");                                                 \
+            for (Value *slot = vm.stack; slot < vm.stackTop; slot++)              \
+            {                                                                     \
+                printf("[ ");                                                     \
+                printValue(*slot);                                                \
+                printf(" ]");                                                     \
+            }                                                                     \
+            printf("\n");                                                         \
+            disassembleInstruction(&frame->closure->function->chunk,              \
+                                   (int)(frame->ip -                              \
+                                         frame->closure->function->chunk.code)); \
+        }                                                                         \
+    } while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+#ifdef DEBUG_PROFILE_OPS
+#define PROFILE_EXECUTION()                                                    \
+    do                                                                         \
+    {                                                                          \
+        if (profileOps)                                                        \
+            profileInstruction(&frame->closure->function->chunk,               \
+                               (int)(frame->ip -                               \
+                                     frame->closure->function->chunk.code));  \
+    } while (false)
+#else
+#define PROFILE_EXECUTION() do { } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT:
-        case OP_CONSTANT_LONG:
-        {
-            int len = instruction == OP_CONSTANT ? 1 : 3;
-            uint64_t constantIdx = 0;
-            for (size_t i = 0; i < len; i++)
-            {
-                constantIdx = (constantIdx << 8) | READ_BYTE();
-            }
 
-            Value constant = READ_CONSTANT(constantIdx);
-            push(constant);
-            break;
-        }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            push(frame->slots[slot]);
-            break;
-        }
-        case OP_SET_LOCAL:
-        {
-            uint8_t slot = READ_BYTE();
-            frame->slots[slot] = peek(0);
-            break;
-        }
-        case OP_GET_GLOBAL:
-        case OP_GET_GLOBAL_LONG:
+// With COMPUTED_GOTO every handler ends in its own indirect jump through
+// dispatchTable, so the branch predictor sees one jump site per opcode
+// instead of the single one at the top of the switch.
+#ifdef COMPUTED_GOTO
+#define CASE(name) TARGET_##name
+    static void *dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&unknown_opcode,
+        [OP_CONSTANT] = &&CASE(OP_CONSTANT),
+        [OP_CONSTANT_LONG] = &&CASE(OP_CONSTANT_LONG),
+        [OP_NIL] = &&CASE(OP_NIL),
+        [OP_TRUE] = &&CASE(OP_TRUE),
+        [OP_FALSE] = &&CASE(OP_FALSE),
+        [OP_POP] = &&CASE(OP_POP),
+        [OP_GET_LOCAL] = &&CASE(OP_GET_LOCAL),
+        [OP_SET_LOCAL] = &&CASE(OP_SET_LOCAL),
+        [OP_GET_GLOBAL] = &&CASE(OP_GET_GLOBAL),
+        [OP_GET_GLOBAL_LONG] = &&CASE(OP_GET_GLOBAL_LONG),
+        [OP_DEFINE_GLOBAL] = &&CASE(OP_DEFINE_GLOBAL),
+        [OP_DEFINE_GLOBAL_LONG] = &&CASE(OP_DEFINE_GLOBAL_LONG),
+        [OP_SET_GLOBAL] = &&CASE(OP_SET_GLOBAL),
+        [OP_SET_GLOBAL_LONG] = &&CASE(OP_SET_GLOBAL_LONG),
+        [OP_GET_UPVALUE] = &&CASE(OP_GET_UPVALUE),
+        [OP_SET_UPVALUE] = &&CASE(OP_SET_UPVALUE),
+        [OP_GET_PROPERTY] = &&CASE(OP_GET_PROPERTY),
+        [OP_SET_PROPERTY] = &&CASE(OP_SET_PROPERTY),
+        [OP_EQUAL] = &&CASE(OP_EQUAL),
+        [OP_GET_SUPER] = &&CASE(OP_GET_SUPER),
+        [OP_GREATER] = &&CASE(OP_GREATER),
+        [OP_LESS] = &&CASE(OP_LESS),
+        [OP_ADD] = &&CASE(OP_ADD),
+        [OP_SUBTRACT] = &&CASE(OP_SUBTRACT),
+        [OP_MULTIPLY] = &&CASE(OP_MULTIPLY),
+        [OP_DIVIDE] = &&CASE(OP_DIVIDE),
+        [OP_NOT] = &&CASE(OP_NOT),
+        [OP_NEGATE] = &&CASE(OP_NEGATE),
+        [OP_PRINT] = &&CASE(OP_PRINT),
+        [OP_JUMP_IF_FALSE] = &&CASE(OP_JUMP_IF_FALSE),
+        [OP_JUMP] = &&CASE(OP_JUMP),
+        [OP_LOOP] = &&CASE(OP_LOOP),
+        [OP_CALL] = &&CASE(OP_CALL),
+        [OP_INVOKE] = &&CASE(OP_INVOKE),
+        [OP_SUPER_INVOKE] = &&CASE(OP_SUPER_INVOKE),
+        [OP_TAIL_CALL] = &&CASE(OP_TAIL_CALL),
+        [OP_TAIL_INVOKE] = &&CASE(OP_TAIL_INVOKE),
+        [OP_TAIL_SUPER_INVOKE] = &&CASE(OP_TAIL_SUPER_INVOKE),
+        [OP_CLOSURE] = &&CASE(OP_CLOSURE),
+        [OP_CLOSE_UPVALUE] = &&CASE(OP_CLOSE_UPVALUE),
+        [OP_RETURN] = &&CASE(OP_RETURN),
+        [OP_CLASS] = &&CASE(OP_CLASS),
+        [OP_INHERIT] = &&CASE(OP_INHERIT),
+        [OP_METHOD] = &&CASE(OP_METHOD),
+        [OP_ADD_NUM] = &&CASE(OP_ADD_NUM),
+        [OP_SUBTRACT_NUM] = &&CASE(OP_SUBTRACT_NUM),
+        [OP_MULTIPLY_NUM] = &&CASE(OP_MULTIPLY_NUM),
+        [OP_DIVIDE_NUM] = &&CASE(OP_DIVIDE_NUM),
+        [OP_LESS_NUM] = &&CASE(OP_LESS_NUM),
+        [OP_GREATER_NUM] = &&CASE(OP_GREATER_NUM),
+#define SUPERINSTRUCTION2(name, a, b) [name] = &&CASE(name),
+#define SUPERINSTRUCTION3(name, a, b, c) [name] = &&CASE(name),
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+    };
+    // Dispatching through this table instead sends every instruction to
+    // the trace recorder first, so recording costs nothing while it is off.
+    static void *recordTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&record,
+    };
+    void *const *dispatch = traceRecording ? recordTable : dispatchTable;
+
+#define INTERPRET_LOOP DISPATCH();
+#define DISPATCH()                                     \
+    do                                                 \
+    {                                                  \
+        TRACE_EXECUTION();                             \
+        PROFILE_EXECUTION();                           \
+        goto *dispatch[instruction = READ_BYTE()];     \
+    } while (false)
+#define START_RECORDING() (dispatch = recordTable)
+#else
+#define INTERPRET_LOOP \
+    loop:              \
+    TRACE_EXECUTION(); \
+    PROFILE_EXECUTION(); \
+    switch (instruction = traceRecording ? traceRecord(frame) : READ_BYTE())
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#define START_RECORDING() do { } while (false)
+#endif
+
+    uint8_t instruction;
+    JIT_ENTER();
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT):
+            DO_OP_CONSTANT();
+            DISPATCH();
+        CASE(OP_CONSTANT_LONG):
+            push(READ_CONSTANT(READ_LONG()));
+            DISPATCH();
+        CASE(OP_NIL):
+            DO_OP_NIL();
+            DISPATCH();
+        CASE(OP_TRUE):
+            DO_OP_TRUE();
+            DISPATCH();
+        CASE(OP_FALSE):
+            DO_OP_FALSE();
+            DISPATCH();
+        CASE(OP_POP):
+            DO_OP_POP();
+            DISPATCH();
+        CASE(OP_GET_LOCAL):
+            DO_OP_GET_LOCAL();
+            DISPATCH();
+        CASE(OP_SET_LOCAL):
+            DO_OP_SET_LOCAL();
+            DISPATCH();
+        CASE(OP_GET_GLOBAL):
+            DO_OP_GET_GLOBAL();
+            DISPATCH();
+        CASE(OP_GET_GLOBAL_LONG):
+            GET_GLOBAL(READ_LONG());
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL):
+            DEFINE_GLOBAL(READ_BYTE());
+            DISPATCH();
+        CASE(OP_DEFINE_GLOBAL_LONG):
+            DEFINE_GLOBAL(READ_LONG());
+            DISPATCH();
+        CASE(OP_SET_GLOBAL):
+            DO_OP_SET_GLOBAL();
+            DISPATCH();
+        CASE(OP_SET_GLOBAL_LONG):
+            SET_GLOBAL(READ_LONG());
+            DISPATCH();
+        CASE(OP_GET_UPVALUE):
+            DO_OP_GET_UPVALUE();
+            DISPATCH();
+        CASE(OP_SET_UPVALUE):
+            DO_OP_SET_UPVALUE();
+            DISPATCH();
+        CASE(OP_GET_PROPERTY):
+            DO_OP_GET_PROPERTY();
+            DISPATCH();
+        CASE(OP_SET_PROPERTY):
+            DO_OP_SET_PROPERTY();
+            DISPATCH();
+        CASE(OP_GET_SUPER):
+            DO_OP_GET_SUPER();
+            DISPATCH();
+        CASE(OP_EQUAL):
+            DO_OP_EQUAL();
+            DISPATCH();
+        CASE(OP_NEGATE):
+            DO_OP_NEGATE();
+            DISPATCH();
+        CASE(OP_GREATER):
+            DO_OP_GREATER();
+            quicken(frame, OP_GREATER_NUM);
+            DISPATCH();
+        CASE(OP_LESS):
+            DO_OP_LESS();
+            quicken(frame, OP_LESS_NUM);
+            DISPATCH();
+        CASE(OP_ADD):
+            DO_OP_ADD();
+            if (IS_NUMBER(peek(0)))
+                quicken(frame, OP_ADD_NUM);
+            DISPATCH();
+        CASE(OP_SUBTRACT):
+            DO_OP_SUBTRACT();
+            quicken(frame, OP_SUBTRACT_NUM);
+            DISPATCH();
+        CASE(OP_MULTIPLY):
+            DO_OP_MULTIPLY();
+            quicken(frame, OP_MULTIPLY_NUM);
+            DISPATCH();
+        CASE(OP_DIVIDE):
+            DO_OP_DIVIDE();
+            quicken(frame, OP_DIVIDE_NUM);
+            DISPATCH();
+        CASE(OP_ADD_NUM):
+            NUMBER_OP(NUMBER_VAL, +);
+            DISPATCH();
+        CASE(OP_SUBTRACT_NUM):
+            NUMBER_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(OP_MULTIPLY_NUM):
+            NUMBER_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(OP_DIVIDE_NUM):
+            NUMBER_OP(NUMBER_VAL, /);
+            DISPATCH();
+        CASE(OP_LESS_NUM):
+            NUMBER_OP(BOOL_VAL, <);
+            DISPATCH();
+        CASE(OP_GREATER_NUM):
+            NUMBER_OP(BOOL_VAL, >);
+            DISPATCH();
+        CASE(OP_NOT):
+            DO_OP_NOT();
+            DISPATCH();
+        CASE(OP_PRINT):
+            DO_OP_PRINT();
+            DISPATCH();
+        CASE(OP_JUMP_IF_FALSE):
+            DO_OP_JUMP_IF_FALSE();
+            DISPATCH();
+        CASE(OP_JUMP):
+            DO_OP_JUMP();
+            DISPATCH();
+        CASE(OP_LOOP):
+            DO_OP_LOOP();
+            TRACE_LOOP();
+            DISPATCH();
+        CASE(OP_CALL):
+            DO_OP_CALL();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_INVOKE):
+            DO_OP_INVOKE();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_SUPER_INVOKE):
+            DO_OP_SUPER_INVOKE();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_TAIL_CALL):
+            DO_OP_TAIL_CALL();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_TAIL_INVOKE):
+            DO_OP_TAIL_INVOKE();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_TAIL_SUPER_INVOKE):
+            DO_OP_TAIL_SUPER_INVOKE();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_CLOSURE):
+            DO_OP_CLOSURE();
+            DISPATCH();
+        CASE(OP_CLOSE_UPVALUE):
+            DO_OP_CLOSE_UPVALUE();
+            DISPATCH();
+        CASE(OP_RETURN):
+            DO_OP_RETURN();
+            JIT_ENTER();
+            DISPATCH();
+        CASE(OP_CLASS):
         {
-            int len = instruction == OP_GET_GLOBAL ? 1 : 3;
+            int len = 1;
             uint64_t constantIdx = 0;
             for (size_t i = 0; i < len; i++)
             {
                 constantIdx = (constantIdx << 8) | READ_BYTE();
             }
-            ObjString *name = READ_STRING(constantIdx);
-            Value value;
-            if (!tableGet(&vm.globals, name, &value))
-            {
-                runtimeError("Undefined variable '%s'.", name->chars);
+            push(OBJ_VAL(newClass(READ_STRING(constantIdx))));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = peek(1);
+            if (!IS_CLASS(superclass)) {
+                runtimeError("Superclass must be a class.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
-            break;
+            inheritMethods(AS_CLASS(superclass), AS_CLASS(peek(0)));
+            pop(); // Subclass.
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL:
-        case OP_DEFINE_GLOBAL_LONG:
+        CASE(OP_METHOD):
         {
-            int len = instruction == OP_DEFINE_GLOBAL ? 1 : 3;
+            int len = 1;
             uint64_t constantIdx = 0;
             for (size_t i = 0; i < len; i++)
             {
                 constantIdx = (constantIdx << 8) | READ_BYTE();
             }
-            ObjString *name = READ_STRING(constantIdx);
-            tableSet(&vm.globals, name, peek(0));
+            defineMethod(AS_CLASS(peek(1)), READ_STRING(constantIdx),
+                         peek(0));
             pop();
-            break;
+            DISPATCH();
         }
-        case OP_SET_GLOBAL:
-        {
-            int len = instruction == OP_SET_GLOBAL ? 1 : 3;
-            uint64_t constantIdx = 0;
-            for (size_t i = 0; i < len; i++)
-            {
-                constantIdx = (constantIdx << 8) | READ_BYTE();
-            }
-            ObjString *name = READ_STRING(constantIdx);
-            if (tableSet(&vm.globals, name, peek(0)))
-            {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+        // A superinstruction runs its components' bodies back to back. The
+        // components' own opcode bytes are still in the chunk right after the
+        // first component's operands, so they are skipped, not decoded. Only
+        // a last component that calls or returns can change frame.
+#define SUPERINSTRUCTION2(name, a, b) \
+        CASE(name):                   \
+        {                             \
+            CallFrame *start = frame; \
+            DO_##a();                 \
+            frame->ip++;              \
+            DO_##b();                 \
+            if (frame != start)       \
+                JIT_ENTER();          \
+            DISPATCH();               \
         }
-        case OP_GET_UPVALUE:
-        {
-            uint8_t slot = READ_BYTE();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+#define SUPERINSTRUCTION3(name, a, b, c) \
+        CASE(name):                      \
+        {                                \
+            CallFrame *start = frame;    \
+            DO_##a();                    \
+            frame->ip++;                 \
+            DO_##b();                    \
+            frame->ip++;                 \
+            DO_##c();                    \
+            if (frame != start)          \
+                JIT_ENTER();             \
+            DISPATCH();                  \
         }
-        case OP_SET_UPVALUE:
-        {
-            uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
-        }
-        case OP_GET_PROPERTY:
-        {
-            if (!IS_INSTANCE(peek(0)))
-            {
-                runtimeError("Only instances have properties.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+    }
 
-            ObjInstance *instance = AS_INSTANCE(peek(0));
-            ObjString *name = READ_STRING(READ_BYTE());
+#ifdef COMPUTED_GOTO
+record:
+    // Hand the instruction just read to the recorder and run the opcode it
+    // returns, going back to the plain table once recording has stopped.
+    frame->ip--;
+    instruction = traceRecord(frame);
+    if (!traceRecording)
+        dispatch = dispatchTable;
+    goto *dispatchTable[instruction];
+#endif
 
-            Value value;
-            if (tableGet(&instance->fields, name, &value))
-            {
-                pop(); // Instance.
-                push(value);
-                break;
-            }
+#ifdef COMPUTED_GOTO
+unknown_opcode:
+#endif
+    // Only reachable through an opcode without a handler.
+    runtimeError("Unknown opcode %d.", instruction);
+    return INTERPRET_RUNTIME_ERROR;
 
-            if (!bindMethod(instance->klass, name))
-            {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SET_PROPERTY:
-        {
-            if (!IS_INSTANCE(peek(1)))
-            {
-                runtimeError("Only instances have fields.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef TRACE_EXECUTION
+#undef PROFILE_EXECUTION
+#undef NUMBER_OP
+#undef JIT_ENTER
+#undef TRACE_LOOP
+#undef START_RECORDING
+}
 
-            ObjInstance *instance = AS_INSTANCE(peek(1));
-            tableSet(&instance->fields, READ_STRING(READ_BYTE()), peek(0));
-            Value value = pop();
-            pop();
-            push(value);
-            break;
-        }
-        case OP_GET_SUPER: {
-            ObjString* name = READ_STRING(READ_BYTE());
-            ObjClass* superclass = AS_CLASS(pop());
+// Out-of-line instruction bodies for the baseline JIT. Like the handlers in
+// run(), each expects frame->ip to point just past its opcode and leaves it
+// just past its operands.
+#define JIT_HELPER(op, body)                               \
+    static InterpretResult jit_##op(CallFrame *frame)      \
+    {                                                      \
+        body;                                              \
+        return INTERPRET_OK;                               \
+    }
+JIT_HELPER(OP_CONSTANT, DO_OP_CONSTANT())
+JIT_HELPER(OP_CONSTANT_LONG, push(READ_CONSTANT(READ_LONG())))
+JIT_HELPER(OP_NIL, DO_OP_NIL())
+JIT_HELPER(OP_TRUE, DO_OP_TRUE())
+JIT_HELPER(OP_FALSE, DO_OP_FALSE())
+JIT_HELPER(OP_POP, DO_OP_POP())
+JIT_HELPER(OP_GET_LOCAL, DO_OP_GET_LOCAL())
+JIT_HELPER(OP_SET_LOCAL, DO_OP_SET_LOCAL())
+JIT_HELPER(OP_GET_GLOBAL, DO_OP_GET_GLOBAL())
+JIT_HELPER(OP_GET_GLOBAL_LONG, GET_GLOBAL(READ_LONG()))
+JIT_HELPER(OP_DEFINE_GLOBAL, DEFINE_GLOBAL(READ_BYTE()))
+JIT_HELPER(OP_DEFINE_GLOBAL_LONG, DEFINE_GLOBAL(READ_LONG()))
+JIT_HELPER(OP_SET_GLOBAL, DO_OP_SET_GLOBAL())
+JIT_HELPER(OP_SET_GLOBAL_LONG, SET_GLOBAL(READ_LONG()))
+JIT_HELPER(OP_GET_UPVALUE, DO_OP_GET_UPVALUE())
+JIT_HELPER(OP_SET_UPVALUE, DO_OP_SET_UPVALUE())
+JIT_HELPER(OP_GET_PROPERTY, DO_OP_GET_PROPERTY())
+JIT_HELPER(OP_SET_PROPERTY, DO_OP_SET_PROPERTY())
+JIT_HELPER(OP_EQUAL, DO_OP_EQUAL())
+JIT_HELPER(OP_GET_SUPER, DO_OP_GET_SUPER())
+JIT_HELPER(OP_GREATER, DO_OP_GREATER())
+JIT_HELPER(OP_LESS, DO_OP_LESS())
+JIT_HELPER(OP_ADD, DO_OP_ADD())
+JIT_HELPER(OP_SUBTRACT, DO_OP_SUBTRACT())
+JIT_HELPER(OP_MULTIPLY, DO_OP_MULTIPLY())
+JIT_HELPER(OP_DIVIDE, DO_OP_DIVIDE())
+JIT_HELPER(OP_NOT, DO_OP_NOT())
+JIT_HELPER(OP_NEGATE, DO_OP_NEGATE())
+JIT_HELPER(OP_PRINT, DO_OP_PRINT())
+JIT_HELPER(OP_CALL, DO_OP_CALL())
+JIT_HELPER(OP_INVOKE, DO_OP_INVOKE())
+JIT_HELPER(OP_SUPER_INVOKE, DO_OP_SUPER_INVOKE())
+JIT_HELPER(OP_TAIL_CALL, DO_OP_TAIL_CALL())
+JIT_HELPER(OP_TAIL_INVOKE, DO_OP_TAIL_INVOKE())
+JIT_HELPER(OP_TAIL_SUPER_INVOKE, DO_OP_TAIL_SUPER_INVOKE())
+JIT_HELPER(OP_CLOSURE, DO_OP_CLOSURE())
+JIT_HELPER(OP_CLOSE_UPVALUE, DO_OP_CLOSE_UPVALUE())
+JIT_HELPER(OP_RETURN, DO_OP_RETURN())
 
-            if (!bindMethod(superclass, name)) {
-              return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
+// Class declarations run once per program and are left to the interpreter,
+// so OP_CLASS, OP_INHERIT and OP_METHOD have no helper.
+const JitHelper jitHelpers[UINT8_COUNT] = {
+#define JIT_HELPER_ENTRY(op) [op] = jit_##op,
+    JIT_HELPER_ENTRY(OP_CONSTANT)
+    JIT_HELPER_ENTRY(OP_CONSTANT_LONG)
+    JIT_HELPER_ENTRY(OP_NIL)
+    JIT_HELPER_ENTRY(OP_TRUE)
+    JIT_HELPER_ENTRY(OP_FALSE)
+    JIT_HELPER_ENTRY(OP_POP)
+    JIT_HELPER_ENTRY(OP_GET_LOCAL)
+    JIT_HELPER_ENTRY(OP_SET_LOCAL)
+    JIT_HELPER_ENTRY(OP_GET_GLOBAL)
+    JIT_HELPER_ENTRY(OP_GET_GLOBAL_LONG)
+    JIT_HELPER_ENTRY(OP_DEFINE_GLOBAL)
+    JIT_HELPER_ENTRY(OP_DEFINE_GLOBAL_LONG)
+    JIT_HELPER_ENTRY(OP_SET_GLOBAL)
+    JIT_HELPER_ENTRY(OP_SET_GLOBAL_LONG)
+    JIT_HELPER_ENTRY(OP_GET_UPVALUE)
+    JIT_HELPER_ENTRY(OP_SET_UPVALUE)
+    JIT_HELPER_ENTRY(OP_GET_PROPERTY)
+    JIT_HELPER_ENTRY(OP_SET_PROPERTY)
+    JIT_HELPER_ENTRY(OP_EQUAL)
+    JIT_HELPER_ENTRY(OP_GET_SUPER)
+    JIT_HELPER_ENTRY(OP_GREATER)
+    JIT_HELPER_ENTRY(OP_LESS)
+    JIT_HELPER_ENTRY(OP_ADD)
+    JIT_HELPER_ENTRY(OP_SUBTRACT)
+    JIT_HELPER_ENTRY(OP_MULTIPLY)
+    JIT_HELPER_ENTRY(OP_DIVIDE)
+    JIT_HELPER_ENTRY(OP_NOT)
+    JIT_HELPER_ENTRY(OP_NEGATE)
+    JIT_HELPER_ENTRY(OP_PRINT)
+    JIT_HELPER_ENTRY(OP_CALL)
+    JIT_HELPER_ENTRY(OP_INVOKE)
+    JIT_HELPER_ENTRY(OP_SUPER_INVOKE)
+    JIT_HELPER_ENTRY(OP_TAIL_CALL)
+    JIT_HELPER_ENTRY(OP_TAIL_INVOKE)
+    JIT_HELPER_ENTRY(OP_TAIL_SUPER_INVOKE)
+    JIT_HELPER_ENTRY(OP_CLOSURE)
+    JIT_HELPER_ENTRY(OP_CLOSE_UPVALUE)
+    JIT_HELPER_ENTRY(OP_RETURN)
+#undef JIT_HELPER_ENTRY
+};
+
+bool jitPeekFalsey()
+{
+    return isFalsey(peek(0));
+}
+
+#undef JIT_HELPER
+#undef BINARY_OP
+#undef CHECK
+#undef GET_GLOBAL
+#undef SET_GLOBAL
+#undef DEFINE_GLOBAL
+#undef DO_OP_CONSTANT
+#undef DO_OP_NIL
+#undef DO_OP_TRUE
+#undef DO_OP_FALSE
+#undef DO_OP_POP
+#undef DO_OP_GET_LOCAL
+#undef DO_OP_SET_LOCAL
+#undef DO_OP_GET_GLOBAL
+#undef DO_OP_SET_GLOBAL
+#undef DO_OP_GET_UPVALUE
+#undef DO_OP_SET_UPVALUE
+#undef DO_OP_GET_PROPERTY
+#undef DO_OP_SET_PROPERTY
+#undef DO_OP_EQUAL
+#undef DO_OP_GREATER
+#undef DO_OP_LESS
+#undef DO_OP_ADD
+#undef DO_OP_SUBTRACT
+#undef DO_OP_MULTIPLY
+#undef DO_OP_DIVIDE
+#undef DO_OP_NOT
+#undef DO_OP_NEGATE
+#undef DO_OP_JUMP_IF_FALSE
+#undef DO_OP_JUMP
+#undef DO_OP_LOOP
+#undef DO_OP_CALL
+#undef DO_OP_INVOKE
+#undef DO_OP_GET_SUPER
+#undef DO_OP_SUPER_INVOKE
+#undef TAIL_CALL
+#undef DO_OP_TAIL_CALL
+#undef DO_OP_TAIL_INVOKE
+#undef DO_OP_TAIL_SUPER_INVOKE
+#undef DO_OP_CLOSURE
+#undef DO_OP_CLOSE_UPVALUE
+#undef DO_OP_PRINT
+#undef DO_OP_RETURN
+#undef READ_SHORT
+#undef READ_LONG
+#undef READ_PROPERTY_CACHE
+#undef READ_METHOD_CACHE
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_BYTE
+
+// Prepares the frame call() just pushed to run register code: its
+// temporaries start out nil, and vm.stackTop sits above all of its slots so
+// that helpers which push, like the ones making calls, do not overwrite
+// them.
+static inline bool enterRegisterFrame(CallFrame *frame)
+{
+    ObjFunction *function = frame->closure->function;
+    RegCode *code = regcodeFor(function);
+    Value *end = frame->slots + code->frameSize;
+    if (end > vm.stackLimit)
+    {
+        vm.frameCount--;
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    for (Value *slot = frame->slots + function->arity + 1; slot < end; slot++)
+        *slot = NIL_VAL;
+    vm.stackTop = end;
+    frame->ip = (uint8_t *)code->code;
+    return true;
+}
+
+// Interpreter for register code; see vm/regcode.h. It shares frames, the
+// value stack and the call and property helpers with run(). A frame's ip
+// points into its register code, and is only brought up to date before an
+// instruction that may call or fail.
+static InterpretResult runRegisters()
+{
+    CallFrame *frame;
+    RegInstruction *code;
+    RegInstruction *pc;
+    RegInstruction *instruction;
+    Chunk *chunk;
+    Value *constants;
+    Value *slots;
+    Value *frameTop;
+
+#define LOAD_FRAME()                                            \
+    do                                                          \
+    {                                                           \
+        frame = &vm.frames[vm.frameCount - 1];                  \
+        RegCode *regcode = frame->closure->function->regcode;   \
+        code = regcode->code;                                   \
+        pc = (RegInstruction *)frame->ip;                       \
+        chunk = &frame->closure->function->chunk;               \
+        constants = regcode->constants;                         \
+        slots = frame->slots;                                   \
+        frameTop = slots + regcode->frameSize;                  \
+    } while (false)
+#define SAVE_PC() (frame->ip = (uint8_t *)pc)
+#define RK(operand)                                     \
+    ((operand) & REG_CONSTANT                           \
+         ? constants[(operand) & ~REG_CONSTANT]         \
+         : slots[(operand)])
+#define WIDE() ((uint32_t)instruction->b | (uint32_t)instruction->c << 16)
+#define ERROR(...)                                      \
+    do                                                  \
+    {                                                   \
+        SAVE_PC();                                      \
+        runtimeError(__VA_ARGS__);                      \
+        return INTERPRET_RUNTIME_ERROR;                 \
+    } while (false)
+#define CHECK(ok)                               \
+    do                                          \
+    {                                           \
+        if (!(ok))                              \
+            return INTERPRET_RUNTIME_ERROR;     \
+    } while (false)
+#define NUMBER_OP(valueType, op)                                        \
+    do                                                                  \
+    {                                                                   \
+        Value b = RK(instruction->b);                                   \
+        Value c = RK(instruction->c);                                   \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c))                             \
+            ERROR("Operands must be numbers.");                         \
+        slots[instruction->a] = valueType(AS_NUMBER(b) op AS_NUMBER(c)); \
+    } while (false)
+#define JUMP_UNLESS(op)                                         \
+    do                                                          \
+    {                                                           \
+        Value a = RK(instruction->a);                           \
+        Value b = RK(instruction->b);                           \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b))                     \
+            ERROR("Operands must be numbers.");                 \
+        if (!(AS_NUMBER(a) op AS_NUMBER(b)))                    \
+            pc = code + instruction->c;                         \
+    } while (false)
+// After a call helper has run: a closure call pushed a frame, which is
+// entered, while anything else left its result in the callee's slot.
+#define ENTER_CALLEE()                                          \
+    do                                                          \
+    {                                                           \
+        if (&vm.frames[vm.frameCount - 1] != frame)             \
+        {                                                       \
+            CHECK(enterRegisterFrame(&vm.frames[vm.frameCount - 1])); \
+            LOAD_FRAME();                                       \
+        }                                                       \
+        else                                                    \
+        {                                                       \
+            vm.stackTop = frameTop;                             \
+        }                                                       \
+    } while (false)
+// Likewise after a tail call, whose callee takes this frame's place.
+#define ENTER_TAIL_CALLEE()                                     \
+    do                                                          \
+    {                                                           \
+        if (&vm.frames[vm.frameCount - 1] != frame)             \
+        {                                                       \
+            replaceCaller();                                    \
+            CHECK(enterRegisterFrame(&vm.frames[vm.frameCount - 1])); \
+            LOAD_FRAME();                                       \
+        }                                                       \
+        else                                                    \
+        {                                                       \
+            vm.stackTop = frameTop;                             \
+        }                                                       \
+    } while (false)
+// The callee and its arguments are in a onwards.
+#define DO_REG_CALL()                                                   \
+    do                                                                  \
+    {                                                                   \
+        SAVE_PC();                                                      \
+        vm.stackTop = slots + instruction->a + instruction->n + 1;      \
+        if (IS_NATIVE(slots[instruction->a]))                           \
+            CHECK(callNative(AS_NATIVE(slots[instruction->a]),          \
+                             instruction->n));                          \
+        else                                                            \
+            CHECK(callValue(slots[instruction->a], instruction->n));    \
+    } while (false)
+#define DO_REG_INVOKE()                                                 \
+    do                                                                  \
+    {                                                                   \
+        SAVE_PC();                                                      \
+        vm.stackTop = slots + instruction->a + instruction->n + 1;      \
+        CHECK(invoke(AS_STRING(constants[instruction->c]),              \
+                     instruction->n,                                    \
+                     &chunk->methodCaches[instruction->b]));            \
+    } while (false)
+#define DO_REG_SUPER_INVOKE()                                           \
+    do                                                                  \
+    {                                                                   \
+        ObjClass *superclass =                                          \
+            AS_CLASS(slots[instruction->a + instruction->n + 1]);       \
+        SAVE_PC();                                                      \
+        vm.stackTop = slots + instruction->a + instruction->n + 1;      \
+        CHECK(invokeFromClass(superclass,                               \
+                              AS_STRING(constants[instruction->c]),     \
+                              instruction->n, (Obj *)superclass,        \
+                              &chunk->methodCaches[instruction->b]));   \
+    } while (false)
+
+#ifdef COMPUTED_GOTO
+#define CASE(name) TARGET_##name
+    static void *dispatchTable[UINT8_COUNT] = {
+        [0 ... UINT8_COUNT - 1] = &&unknown_opcode,
+        [REG_MOVE] = &&CASE(REG_MOVE),
+        [REG_LOAD_CONSTANT] = &&CASE(REG_LOAD_CONSTANT),
+        [REG_GET_GLOBAL] = &&CASE(REG_GET_GLOBAL),
+        [REG_DEFINE_GLOBAL] = &&CASE(REG_DEFINE_GLOBAL),
+        [REG_SET_GLOBAL] = &&CASE(REG_SET_GLOBAL),
+        [REG_GET_UPVALUE] = &&CASE(REG_GET_UPVALUE),
+        [REG_SET_UPVALUE] = &&CASE(REG_SET_UPVALUE),
+        [REG_GET_PROPERTY] = &&CASE(REG_GET_PROPERTY),
+        [REG_SET_PROPERTY] = &&CASE(REG_SET_PROPERTY),
+        [REG_GET_SUPER] = &&CASE(REG_GET_SUPER),
+        [REG_EQUAL] = &&CASE(REG_EQUAL),
+        [REG_GREATER] = &&CASE(REG_GREATER),
+        [REG_LESS] = &&CASE(REG_LESS),
+        [REG_ADD] = &&CASE(REG_ADD),
+        [REG_SUBTRACT] = &&CASE(REG_SUBTRACT),
+        [REG_MULTIPLY] = &&CASE(REG_MULTIPLY),
+        [REG_DIVIDE] = &&CASE(REG_DIVIDE),
+        [REG_NOT] = &&CASE(REG_NOT),
+        [REG_NEGATE] = &&CASE(REG_NEGATE),
+        [REG_PRINT] = &&CASE(REG_PRINT),
+        [REG_JUMP] = &&CASE(REG_JUMP),
+        [REG_JUMP_IF_FALSE] = &&CASE(REG_JUMP_IF_FALSE),
+        [REG_JUMP_UNLESS_EQUAL] = &&CASE(REG_JUMP_UNLESS_EQUAL),
+        [REG_JUMP_UNLESS_GREATER] = &&CASE(REG_JUMP_UNLESS_GREATER),
+        [REG_JUMP_UNLESS_LESS] = &&CASE(REG_JUMP_UNLESS_LESS),
+        [REG_CALL] = &&CASE(REG_CALL),
+        [REG_INVOKE] = &&CASE(REG_INVOKE),
+        [REG_SUPER_INVOKE] = &&CASE(REG_SUPER_INVOKE),
+        [REG_TAIL_CALL] = &&CASE(REG_TAIL_CALL),
+        [REG_TAIL_INVOKE] = &&CASE(REG_TAIL_INVOKE),
+        [REG_TAIL_SUPER_INVOKE] = &&CASE(REG_TAIL_SUPER_INVOKE),
+        [REG_CLOSURE] = &&CASE(REG_CLOSURE),
+        [REG_CLOSE_UPVALUE] = &&CASE(REG_CLOSE_UPVALUE),
+        [REG_RETURN] = &&CASE(REG_RETURN),
+        [REG_CLASS] = &&CASE(REG_CLASS),
+        [REG_INHERIT] = &&CASE(REG_INHERIT),
+        [REG_METHOD] = &&CASE(REG_METHOD),
+    };
+#define INTERPRET_LOOP DISPATCH();
+#define DISPATCH() goto *dispatchTable[(instruction = pc++)->op]
+#else
+#define INTERPRET_LOOP \
+    loop:              \
+    switch ((instruction = pc++)->op)
+#define CASE(name) case name
+#define DISPATCH() goto loop
+#endif
+
+    CHECK(enterRegisterFrame(&vm.frames[vm.frameCount - 1]));
+    LOAD_FRAME();
+    INTERPRET_LOOP
+    {
+        CASE(REG_MOVE):
+            slots[instruction->a] = RK(instruction->b);
+            DISPATCH();
+        CASE(REG_LOAD_CONSTANT):
+            slots[instruction->a] = constants[WIDE()];
+            DISPATCH();
+        CASE(REG_GET_GLOBAL):
+        {
+            uint32_t slot = WIDE();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value))
+                ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
+            slots[instruction->a] = value;
+            DISPATCH();
         }
-        case OP_EQUAL:
+        CASE(REG_DEFINE_GLOBAL):
+            vm.globalValues.values[WIDE()] = RK(instruction->a);
+            DISPATCH();
+        CASE(REG_SET_GLOBAL):
         {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+            uint32_t slot = WIDE();
+            if (IS_UNDEFINED(vm.globalValues.values[slot]))
+                ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
+            vm.globalValues.values[slot] = RK(instruction->a);
+            DISPATCH();
         }
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
-            {
-                runtimeError("Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
+        CASE(REG_GET_UPVALUE):
+            slots[instruction->a] =
+                *frame->closure->upvalues[instruction->b]->location;
+            DISPATCH();
+        CASE(REG_SET_UPVALUE):
+            setUpvalue(frame->closure->upvalues[instruction->b],
+                       RK(instruction->a));
+            DISPATCH();
+        CASE(REG_GET_PROPERTY):
+            SAVE_PC();
+            CHECK(loadProperty(RK(instruction->b),
+                               AS_STRING(constants[instruction->n]),
+                               &chunk->propertyCaches[instruction->c],
+                               &slots[instruction->a]));
+            DISPATCH();
+        CASE(REG_SET_PROPERTY):
+            SAVE_PC();
+            CHECK(storeProperty(RK(instruction->a),
+                                AS_STRING(constants[instruction->n]),
+                                &chunk->propertyCaches[instruction->c],
+                                RK(instruction->b)));
+            DISPATCH();
+        CASE(REG_GET_SUPER):
+            SAVE_PC();
+            CHECK(bindMethod(AS_CLASS(slots[instruction->a + 1]),
+                             AS_STRING(constants[instruction->n]),
+                             &chunk->methodCaches[instruction->b],
+                             slots[instruction->a], &slots[instruction->a]));
+            DISPATCH();
+        CASE(REG_EQUAL):
+            slots[instruction->a] = BOOL_VAL(
+                valuesEqual(RK(instruction->b), RK(instruction->c)));
+            DISPATCH();
+        CASE(REG_GREATER):
+            NUMBER_OP(BOOL_VAL, >);
+            DISPATCH();
+        CASE(REG_LESS):
+            NUMBER_OP(BOOL_VAL, <);
+            DISPATCH();
+        CASE(REG_ADD):
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            Value b = RK(instruction->b);
+            Value c = RK(instruction->c);
+            if (IS_NUMBER(b) && IS_NUMBER(c))
             {
-                concatenate();
+                slots[instruction->a] = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+            else if (IS_STRING(b) && IS_STRING(c))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                slots[instruction->a] =
+                    OBJ_VAL(concatenate(AS_STRING(b), AS_STRING(c)));
             }
             else
             {
-                runtimeError(
-                    "Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_PRINT:
-        {
-            printValue(pop());
-            printf("\n");
-            break;
-        }
-        case OP_JUMP_IF_FALSE:
-        {
-            uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0)))
-                frame->ip += offset;
-            break;
-        }
-        case OP_JUMP:
-        {
-            uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
-        }
-        case OP_LOOP:
-        {
-            uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
-        }
-        case OP_CALL:
-        {
-            int argCount = READ_BYTE();
-            if (!callValue(peek(argCount), argCount))
-            {
-                return INTERPRET_RUNTIME_ERROR;
+                ERROR("Operands must be two numbers or two strings.");
             }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            DISPATCH();
         }
-        case OP_INVOKE:
+        CASE(REG_SUBTRACT):
+            NUMBER_OP(NUMBER_VAL, -);
+            DISPATCH();
+        CASE(REG_MULTIPLY):
+            NUMBER_OP(NUMBER_VAL, *);
+            DISPATCH();
+        CASE(REG_DIVIDE):
+            NUMBER_OP(NUMBER_VAL, /);
+            DISPATCH();
+        CASE(REG_NOT):
+            slots[instruction->a] = BOOL_VAL(isFalsey(RK(instruction->b)));
+            DISPATCH();
+        CASE(REG_NEGATE):
         {
-            ObjString *method = READ_STRING(READ_BYTE());
-            int argCount = READ_BYTE();
-            if (!invoke(method, argCount))
-            {
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            Value b = RK(instruction->b);
+            if (!IS_NUMBER(b))
+                ERROR("Operand must be a number.");
+            slots[instruction->a] = NUMBER_VAL(-AS_NUMBER(b));
+            DISPATCH();
         }
-        case OP_SUPER_INVOKE: {
-            ObjString* method = READ_STRING(READ_BYTE());
-            int argCount = READ_BYTE();
-            ObjClass* superclass = AS_CLASS(pop());
-            if (!invokeFromClass(superclass, method, argCount)) {
-              return INTERPRET_RUNTIME_ERROR;
-            }
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
-        }
-        case OP_CLOSURE:
+        CASE(REG_PRINT):
+            printValue(RK(instruction->a));
+            putchar('\n');
+            DISPATCH();
+        CASE(REG_JUMP):
+            pc = code + WIDE();
+            DISPATCH();
+        CASE(REG_JUMP_IF_FALSE):
+            if (isFalsey(RK(instruction->a)))
+                pc = code + WIDE();
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_EQUAL):
+            if (!valuesEqual(RK(instruction->a), RK(instruction->b)))
+                pc = code + instruction->c;
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_GREATER):
+            JUMP_UNLESS(>);
+            DISPATCH();
+        CASE(REG_JUMP_UNLESS_LESS):
+            JUMP_UNLESS(<);
+            DISPATCH();
+        CASE(REG_CALL):
+            DO_REG_CALL();
+            ENTER_CALLEE();
+            DISPATCH();
+        CASE(REG_INVOKE):
+            DO_REG_INVOKE();
+            ENTER_CALLEE();
+            DISPATCH();
+        CASE(REG_SUPER_INVOKE):
+            DO_REG_SUPER_INVOKE();
+            ENTER_CALLEE();
+            DISPATCH();
+        CASE(REG_TAIL_CALL):
+            DO_REG_CALL();
+            ENTER_TAIL_CALLEE();
+            DISPATCH();
+        CASE(REG_TAIL_INVOKE):
+            DO_REG_INVOKE();
+            ENTER_TAIL_CALLEE();
+            DISPATCH();
+        CASE(REG_TAIL_SUPER_INVOKE):
+            DO_REG_SUPER_INVOKE();
+            ENTER_TAIL_CALLEE();
+            DISPATCH();
+        CASE(REG_CLOSURE):
         {
-            int len = 1;
-            uint64_t constantIdx = 0;
-            for (size_t i = 0; i < len; i++)
-            {
-                constantIdx = (constantIdx << 8) | READ_BYTE();
-            }
-            ObjFunction *function = AS_FUNCTION(READ_CONSTANT(constantIdx));
-            ObjClosure *closure = newClosure(function);
-            push(OBJ_VAL(closure));
-            for (int i = 0; i < closure->upvalueCount; i++)
-            {
-                uint8_t isLocal = READ_BYTE();
-                uint8_t index = READ_BYTE();
-                if (isLocal)
-                {
-                    closure->upvalues[i] =
-                        captureUpvalue(frame->slots + index);
-                }
-                else
-                {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
-            break;
+            ObjFunction *function = AS_FUNCTION(constants[instruction->n]);
+            ObjClosure *closure = makeClosure(frame, function);
+            slots[instruction->a] = OBJ_VAL(closure);
+            captureUpvalues(frame, closure, chunk->code + WIDE());
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
-            closeUpvalues(vm.stackTop - 1);
-            pop();
-            break;
-        case OP_RETURN:
+        CASE(REG_CLOSE_UPVALUE):
+            closeUpvalues(slots + instruction->a);
+            DISPATCH();
+        CASE(REG_RETURN):
         {
-            Value result = pop();
-            closeUpvalues(frame->slots);
+            Value result = RK(instruction->a);
+            closeUpvalues(slots);
             vm.frameCount--;
             if (vm.frameCount == 0)
             {
-                pop();
+                vm.stackTop = slots;
                 return INTERPRET_OK;
             }
 
-            vm.stackTop = frame->slots;
-            push(result);
-            frame = &vm.frames[vm.frameCount - 1];
-            break;
+            slots[0] = result;
+            LOAD_FRAME();
+            vm.stackTop = frameTop;
+            DISPATCH();
         }
-        case OP_CLASS:
+        CASE(REG_CLASS):
+            slots[instruction->a] =
+                OBJ_VAL(newClass(AS_STRING(constants[instruction->n])));
+            DISPATCH();
+        CASE(REG_INHERIT):
         {
-            int len = 1;
-            uint64_t constantIdx = 0;
-            for (size_t i = 0; i < len; i++)
-            {
-                constantIdx = (constantIdx << 8) | READ_BYTE();
-            }
-            push(OBJ_VAL(newClass(READ_STRING(constantIdx))));
-            break;
-        }
-        case OP_INHERIT: {
-            Value superclass = peek(1);
-            if (!IS_CLASS(superclass)) {
-                runtimeError("Superclass must be a class.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            ObjClass* subclass = AS_CLASS(peek(0));
-            tableAddAll(&AS_CLASS(superclass)->methods,
-                        &subclass->methods);
-            pop(); // Subclass.
-            break;
-        }
-        case OP_METHOD:
-        {
-            int len = 1;
-            uint64_t constantIdx = 0;
-            for (size_t i = 0; i < len; i++)
-            {
-                constantIdx = (constantIdx << 8) | READ_BYTE();
-            }
-            defineMethod(READ_STRING(constantIdx));
-            break;
-        }
+            Value superclass = RK(instruction->a);
+            if (!IS_CLASS(superclass))
+                ERROR("Superclass must be a class.");
+            inheritMethods(AS_CLASS(superclass), AS_CLASS(RK(instruction->b)));
+            DISPATCH();
         }
+        CASE(REG_METHOD):
+            defineMethod(AS_CLASS(RK(instruction->a)),
+                         AS_STRING(constants[instruction->n]),
+                         RK(instruction->b));
+            DISPATCH();
     }
 
-#undef BINARY_OP
-#undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
-#undef READ_BYTE
+#ifdef COMPUTED_GOTO
+unknown_opcode:
+#endif
+    // Only reachable through an opcode without a handler.
+    ERROR("Unknown opcode %d.", instruction->op);
+
+#undef LOAD_FRAME
+#undef SAVE_PC
+#undef RK
+#undef WIDE
+#undef ERROR
+#undef CHECK
+#undef NUMBER_OP
+#undef JUMP_UNLESS
+#undef ENTER_CALLEE
+#undef ENTER_TAIL_CALLEE
+#undef DO_REG_CALL
+#undef DO_REG_INVOKE
+#undef DO_REG_SUPER_INVOKE
+#undef CASE
+#undef DISPATCH
+#undef INTERPRET_LOOP
 }
 
 InterpretResult interpret(const char *source)
@@ -696,5 +2047,5 @@ InterpretResult interpret(const char *source)
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    return registerVM ? runRegisters() : run();
 }
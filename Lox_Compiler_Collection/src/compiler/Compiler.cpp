@@ -12,6 +12,7 @@
 #include "Compiler/compiler.h"
 #include "Compiler/Parser/Parser.h"
 #include "vm/object.h"
+#include "vm/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "disassembler/debug.h"
@@ -45,6 +46,14 @@ typedef struct {
   lox::Token name;
   int depth;
   bool isCaptured;
+  // Whether it may be assigned after its declaration, so closures must
+  // capture it by reference.
+  bool reassigned;
+  int start; // Code offset of its declaration.
+  // The function a fun declaration put here, if its closure may be made in
+  // the frame, and whether the local has been read other than to call it.
+  ObjFunction* function;
+  bool escapes;
 } Local;
 
 typedef struct {
@@ -59,6 +68,15 @@ typedef enum {
   TYPE_SCRIPT
 } FunctionType;
 
+// The instructions that read a method, `a.b` or `super.b`, from just after
+// the receiver to their end.
+typedef struct {
+  int start;
+  int end;
+  uint8_t name;
+  bool isSuper;
+} PropertyGet;
+
 typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
@@ -68,6 +86,11 @@ typedef struct Compiler {
   int localCount;
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
+  int lastCall; // Offset of the last call instruction emitted, or -1.
+  PropertyGet lastGet;
+  int lastLabel; // Offset the last forward jump was patched to land on.
+  int frameClosuresSize; // Bytes of frame storage given to closures.
+  bool sharesUpvalues; // Whether a nested function captures an upvalue.
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -124,9 +147,55 @@ void emitReturn() {
   emitByte(OP_RETURN);
 }
 
+// A closure that was only ever called through local cannot outlive the
+// frame, so the function's closures are made in the frame from then on,
+// while it has room.
+static void placeFrameClosures(Local* local) {
+  if (local->function == NULL || local->isCaptured || local->escapes) return;
+
+  size_t size = frameClosureSize(local->function);
+  if (current->frameClosuresSize + size > FRAME_CLOSURES_MAX) return;
+  local->function->frameOffset = current->frameClosuresSize;
+  current->frameClosuresSize += (int)size;
+}
+
+// Rewrites the closures that capture local, which is never assigned again,
+// to copy its value instead of sharing an upvalue over its slot.
+static void captureByValue(Local* local) {
+  Chunk* chunk = currentChunk();
+  int slot = (int)(local - current->locals);
+  for (int offset = local->start; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (chunk->code[offset] != OP_CLOSURE) continue;
+
+    ObjFunction* function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    uint8_t* captures = &chunk->code[offset + 2];
+    for (int i = 0; i < function->upvalueCount; i++) {
+      if (captures[2 * i] == CAPTURE_LOCAL && captures[2 * i + 1] == slot) {
+        captures[2 * i] = CAPTURE_VALUE;
+        function->cellCount++;
+      }
+    }
+  }
+  local->isCaptured = false;
+}
+
+// Called as local goes out of scope, once every use of it has been seen.
+static void endLocal(Local* local) {
+  placeFrameClosures(local);
+  if (local->isCaptured && !local->reassigned) captureByValue(local);
+}
+
 static ObjFunction* endCompiler() {
+  for (int i = 0; i < current->localCount; i++) {
+    endLocal(&current->locals[i]);
+  }
   emitReturn();
   ObjFunction* function = current->function;
+  if (!parser->hasError() && !profileOps) {
+    fuseSuperinstructions(currentChunk());
+  }
 
 #ifdef DEBUG_PRINT_CODE
   if (debug && !parser->hasError()) {
@@ -149,7 +218,9 @@ static void endScope() {
   while (current->localCount > 0 &&
     current->locals[current->localCount - 1].depth >
        current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
+    Local* local = &current->locals[current->localCount - 1];
+    endLocal(local);
+    if (local->isCaptured) {
       emitByte(OP_CLOSE_UPVALUE);
     } else {
       emitByte(OP_POP);
@@ -166,8 +237,11 @@ static void and_(bool canAssign);
 static void or_(bool canAssign);
 static uint8_t argumentList();
 static int resolveUpvalue(Compiler* compiler, lox::Token& name);
+static void markReassigned(Compiler* compiler, int upvalue);
 static bool identifiersEqual(lox::Token& a, lox::Token& b);
 static uint64_t identifierConstant(lox::Token& name);
+static uint64_t globalVariable(lox::Token& name);
+static void namedVariable(lox::Token name, bool canAssign);
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
@@ -191,8 +265,42 @@ static void binary(bool canAssign) {
   }
 }
 
+static void emitPropertyCache() {
+  int cache = addPropertyCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    parser->parseError("Too many property accesses in function.");
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
+static void emitMethodCache() {
+  int cache = addMethodCache(currentChunk());
+  if (cache > UINT16_MAX) {
+    parser->parseError("Too many method calls in function.");
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 static void call(bool canAssign) {
+  // `(a.b)(...)`: the method read just before can be invoked instead of
+  // bound to a new ObjBoundMethod. Not when a jump lands after the read, as
+  // in `(a or b.c)(...)`.
+  PropertyGet get = current->lastGet;
+  if (get.end == currentChunk()->count && current->lastLabel != get.end) {
+    truncateChunk(currentChunk(), get.start);
+    uint8_t argCount = argumentList();
+    if (get.isSuper) namedVariable(lox::Token("super"), false);
+    current->lastCall = currentChunk()->count;
+    emitBytes(get.isSuper ? OP_SUPER_INVOKE : OP_INVOKE, get.name);
+    emitByte(argCount);
+    emitMethodCache();
+    return;
+  }
+
   uint8_t argCount = argumentList();
+  current->lastCall = currentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -203,12 +311,20 @@ static void dot(bool canAssign) {
   if (canAssign && parser->parseOptional(lox::TokenType::TOKEN_EQUAL)) {
     expression();
     emitBytes(OP_SET_PROPERTY, name);
+    emitPropertyCache();
   } else if (parser->parseOptional(lox::TokenType::TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_INVOKE, name);
     emitByte(argCount);
+    emitMethodCache();
   } else {
+    current->lastGet.start = currentChunk()->count;
     emitBytes(OP_GET_PROPERTY, name);
+    emitPropertyCache();
+    current->lastGet.end = currentChunk()->count;
+    current->lastGet.name = name;
+    current->lastGet.isSuper = false;
   }
 }
 
@@ -234,7 +350,7 @@ uint64_t makeConstant(Value value) {
 void emitConstant(Value value) {
   uint64_t constant = makeConstant(value);
   if (constant > UINT8_MAX) {
-    emitBytes(OP_CONSTANT, constant >> 16);
+    emitBytes(OP_CONSTANT_LONG, constant >> 16);
     emitBytes(constant >> 8, constant);
   }
   else {
@@ -252,6 +368,7 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  current->lastLabel = currentChunk()->count;
 }
 
 static void initCompiler(Compiler* compiler, FunctionType type) {
@@ -260,6 +377,11 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->lastGet.end = -1;
+  compiler->lastLabel = -1;
+  compiler->frameClosuresSize = 0;
+  compiler->sharesUpvalues = false;
   compiler->function = newFunction();
   current = compiler;
   if (type != TYPE_SCRIPT) {
@@ -270,6 +392,10 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   Local* local = &current->locals[current->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->reassigned = false;
+  local->start = currentChunk()->count;
+  local->function = NULL;
+  local->escapes = false;
   if (type != TYPE_FUNCTION) {
     local->name = lox::Token("this");
   } else {
@@ -298,15 +424,24 @@ static void namedVariable(lox::Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(name);
+    arg = globalVariable(name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
   if (canAssign && parser->parseOptional(lox::TokenType::TOKEN_EQUAL)) {
     expression();
     op = setOp;
+    if (op == OP_SET_LOCAL) {
+      current->locals[arg].reassigned = true;
+    } else if (op == OP_SET_UPVALUE) {
+      markReassigned(current, arg);
+    }
   } else {
     op = getOp;
+    if (op == OP_GET_LOCAL &&
+        !parser->match(lox::TokenType::TOKEN_LEFT_PAREN)) {
+      current->locals[arg].escapes = true;
+    }
   }
   if (arg > UINT8_MAX) {
     emitWord(op + 1, arg >> 16, arg >> 8, arg);
@@ -335,11 +470,18 @@ static void super_(bool canAssign) {
   if (parser->parseOptional(lox::TokenType::TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(lox::Token("super"), false);
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_SUPER_INVOKE, name);
     emitByte(argCount);
+    emitMethodCache();
   } else {
+    current->lastGet.start = currentChunk()->count;
     namedVariable(lox::Token("super"), false);
     emitBytes(OP_GET_SUPER, name);
+    emitMethodCache();
+    current->lastGet.end = currentChunk()->count;
+    current->lastGet.name = name;
+    current->lastGet.isSuper = true;
   }
 }
 
@@ -436,6 +578,11 @@ static uint64_t identifierConstant(lox::Token& name) {
   return makeConstant(OBJ_VAL(copyString(str.data(), str.length())));
 }
 
+static uint64_t globalVariable(lox::Token& name) {
+  std::string_view str = name.getTokenString();
+  return (uint64_t)globalSlot(copyString(str.data(), str.length()));
+}
+
 static int resolveLocal(Compiler* compiler, lox::Token& name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
@@ -481,12 +628,23 @@ static int resolveUpvalue(Compiler* compiler, lox::Token& name) {
 
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
+    compiler->enclosing->sharesUpvalues = true;
     return addUpvalue(compiler, (uint8_t)upvalue, false);
   }
 
   return -1;
 }
 
+// Marks the local that upvalue of compiler's function ends up capturing.
+static void markReassigned(Compiler* compiler, int upvalue) {
+  Upvalue* captured = &compiler->upvalues[upvalue];
+  if (captured->isLocal) {
+    compiler->enclosing->locals[captured->index].reassigned = true;
+  } else {
+    markReassigned(compiler->enclosing, captured->index);
+  }
+}
+
 static bool identifiersEqual(lox::Token& a, lox::Token& b) {
   std::string_view strA = a.getTokenString();
   std::string_view strB = b.getTokenString();
@@ -504,6 +662,10 @@ static void addLocal(lox::Token name) {
   local->name = name;
   local->depth = -1;
   local->isCaptured = false;
+  local->reassigned = false;
+  local->start = currentChunk()->count;
+  local->function = NULL;
+  local->escapes = false;
 }
 
 static void declareVariable() {
@@ -528,7 +690,7 @@ static uint64_t parseVariable() {
   parser->parse(lox::TokenType::TOKEN_IDENTIFIER);
   declareVariable();
   if (current->scopeDepth > 0) return 0;
-  return identifierConstant(parser->getPreviousToken());
+  return globalVariable(parser->getPreviousToken());
 }
 
 static void markInitialized() {
@@ -603,7 +765,9 @@ static void block() {
   parser->parse(lox::TokenType::TOKEN_RIGHT_BRACE);
 }
 
-static void function(FunctionType type) {
+// Returns the function, unless its closures must go on the heap however
+// they are used.
+static ObjFunction* function(FunctionType type) {
   Compiler compiler;
   initCompiler(&compiler, type);
   beginScope();
@@ -627,9 +791,15 @@ static void function(FunctionType type) {
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+    if (compiler.upvalues[i].isLocal) {
+      emitByte(CAPTURE_LOCAL);
+    } else {
+      emitByte(CAPTURE_UPVALUE);
+      function->cellCount++;
+    }
     emitByte(compiler.upvalues[i].index);
   }
+  return compiler.sharesUpvalues ? NULL : function;
 }
 
 static void method() {
@@ -648,10 +818,11 @@ static void classDeclaration() {
   parser->parse(lox::TokenType::TOKEN_IDENTIFIER);
   lox::Token className = parser->getPreviousToken();
   uint8_t nameConstant = identifierConstant(parser->getPreviousToken());
+  uint64_t global = current->scopeDepth > 0 ? 0 : globalVariable(className);
   declareVariable();
 
   emitBytes(OP_CLASS, nameConstant);
-  defineVariable(nameConstant);
+  defineVariable(global);
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -690,9 +861,16 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-  uint8_t global = parseVariable();
+  uint64_t global = parseVariable();
   markInitialized();
-  function(TYPE_FUNCTION);
+  ObjFunction* declared = function(TYPE_FUNCTION);
+  if (current->scopeDepth > 0) {
+    Local* local = &current->locals[current->localCount - 1];
+    local->function = declared;
+    // A function that refers to itself captures the slot before its
+    // closure is stored there.
+    if (local->isCaptured) local->reassigned = true;
+  }
   defineVariable(global);
 }
 
@@ -790,6 +968,24 @@ static void printStatement() {
   emitByte(OP_PRINT);
 }
 
+// Turns the call just emitted, if the return value is its result, into the
+// tail call form. The OP_RETURN after it stays: a jump may land on it, and
+// calls that push no frame fall through to it.
+static void markTailCall() {
+  Chunk* chunk = currentChunk();
+  int call = current->lastCall;
+  if (call < 0 || call + instructionLength(chunk, call) != chunk->count) {
+    return;
+  }
+
+  switch (chunk->code[call]) {
+    case OP_CALL: chunk->code[call] = OP_TAIL_CALL; break;
+    case OP_INVOKE: chunk->code[call] = OP_TAIL_INVOKE; break;
+    case OP_SUPER_INVOKE: chunk->code[call] = OP_TAIL_SUPER_INVOKE; break;
+    default: break;
+  }
+}
+
 static void returnStatement() {
   if (current->type == TYPE_SCRIPT) {
     parser->parseError("Can't return from top-level code.");
@@ -804,6 +1000,7 @@ static void returnStatement() {
 
     expression();
     parser->parse(lox::TokenType::TOKEN_SEMICOLON);
+    markTailCall();
     emitByte(OP_RETURN);
   }
 }
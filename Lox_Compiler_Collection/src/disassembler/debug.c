@@ -2,6 +2,7 @@
 
 #include "disassembler/debug.h"
 #include "vm/object.h"
+#include "vm/vm.h"
 #include "value.h"
 
 void disassembleChunk(Chunk *chunk, const char *name)
@@ -21,8 +22,7 @@ int constantInstruction(const char *name, Chunk *chunk,
   uint8_t len = 1;
   uint64_t constant = 0;
 
-  if (instruction == OP_CONSTANT_LONG || instruction == OP_GET_GLOBAL_LONG ||
-      instruction == OP_DEFINE_GLOBAL_LONG || instruction == OP_SET_GLOBAL_LONG)
+  if (instruction == OP_CONSTANT_LONG)
     len = 3;
 
   for (size_t i = 1; i <= len; i++)
@@ -35,14 +35,48 @@ int constantInstruction(const char *name, Chunk *chunk,
   return offset + 1 + len;
 }
 
+static int globalInstruction(const char *name, Chunk *chunk,
+                             int offset)
+{
+  uint8_t instruction = chunk->code[offset];
+  uint8_t len = 1;
+  uint64_t slot = 0;
+
+  if (instruction == OP_GET_GLOBAL_LONG || instruction == OP_DEFINE_GLOBAL_LONG ||
+      instruction == OP_SET_GLOBAL_LONG)
+    len = 3;
+
+  for (size_t i = 1; i <= len; i++)
+  {
+    slot = (slot << 8) + chunk->code[offset + i];
+  }
+  printf("%-16s\t%4lu\t'", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + 1 + len;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk,
   int offset) {
   uint8_t constant = chunk->code[offset + 1];
   uint8_t argCount = chunk->code[offset + 2];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
-  printf("'\n");
-  return offset + 3;
+  printf("' ic %d\n", cache);
+  return offset + 5;
+}
+
+static int cacheInstruction(const char* name, Chunk* chunk,
+  int offset) {
+  uint8_t constant = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' ic %d\n", cache);
+  return offset + 4;
 }
 
 int simpleInstruction(const char *name, int offset)
@@ -51,6 +85,23 @@ int simpleInstruction(const char *name, int offset)
   return offset + 1;
 }
 
+// Prints a quickened instruction together with the generic instruction it
+// replaced, as recorded in the chunk's pre-quickening copy.
+static int quickenedInstruction(const char* name, Chunk* chunk,
+  int offset) {
+  const char* original = "?";
+  switch (chunk->original[offset]) {
+    case OP_ADD:      original = "OP_ADD"; break;
+    case OP_SUBTRACT: original = "OP_SUBTRACT"; break;
+    case OP_MULTIPLY: original = "OP_MULTIPLY"; break;
+    case OP_DIVIDE:   original = "OP_DIVIDE"; break;
+    case OP_LESS:     original = "OP_LESS"; break;
+    case OP_GREATER:  original = "OP_GREATER"; break;
+  }
+  printf("%-16s (%s)\n", name, original);
+  return offset + 1;
+}
+
 static int byteInstruction(const char* name, Chunk* chunk,
   int offset) {
   uint8_t slot = chunk->code[offset + 1];
@@ -67,14 +118,8 @@ static int jumpInstruction(const char* name, int sign,
   return offset + 3;
 }
 
-int disassembleInstruction(Chunk *chunk, int offset)
+static int operationInstruction(Chunk *chunk, int offset, uint8_t instruction)
 {
-  printf("%04d ", offset);
-
-  LineInfo line = getLineInfo(chunk, offset);
-  printf("[%3d:%3d]\t", line.line, line.column);
-
-  uint8_t instruction = chunk->code[offset];
   switch (instruction)
   {
   case OP_CONSTANT:
@@ -94,31 +139,31 @@ int disassembleInstruction(Chunk *chunk, int offset)
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL_LONG:
-    return constantInstruction("OP_GET_GLOBAL_LONG", chunk,
-                                 offset);
+    return globalInstruction("OP_GET_GLOBAL_LONG", chunk,
+                               offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk,
-                                 offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk,
+                               offset);
   case OP_DEFINE_GLOBAL_LONG:
-    return constantInstruction("OP_DEFINE_GLOBAL_LONG", chunk,
-                                 offset);
+    return globalInstruction("OP_DEFINE_GLOBAL_LONG", chunk,
+                               offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL_LONG:
-    return constantInstruction("OP_SET_GLOBAL_LONG", chunk,
-                                 offset);
+    return globalInstruction("OP_SET_GLOBAL_LONG", chunk,
+                               offset);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_GET_PROPERTY:
-    return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+    return cacheInstruction("OP_GET_PROPERTY", chunk, offset);
   case OP_SET_PROPERTY:
-    return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+    return cacheInstruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_SUPER:
-    return constantInstruction("OP_GET_SUPER", chunk, offset);
+    return cacheInstruction("OP_GET_SUPER", chunk, offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -151,6 +196,12 @@ int disassembleInstruction(Chunk *chunk, int offset)
     return invokeInstruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
+  case OP_TAIL_INVOKE:
+    return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+  case OP_TAIL_SUPER_INVOKE:
+    return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t constant = chunk->code[offset++];
@@ -161,10 +212,12 @@ int disassembleInstruction(Chunk *chunk, int offset)
     ObjFunction* function = AS_FUNCTION(
     chunk->constants.values[constant]);
     for (int j = 0; j < function->upvalueCount; j++) {
-      int isLocal = chunk->code[offset++];
+      int capture = chunk->code[offset++];
       int index = chunk->code[offset++];
       printf("%04d      |                     %s %d\n",
-            offset - 2, isLocal ? "local" : "upvalue", index);
+            offset - 2, capture == CAPTURE_UPVALUE ? "upvalue"
+                        : capture == CAPTURE_LOCAL ? "local" : "value",
+            index);
     }
     return offset;
   }
@@ -178,8 +231,53 @@ int disassembleInstruction(Chunk *chunk, int offset)
     return simpleInstruction("OP_INHERIT", offset);
   case OP_METHOD:
     return constantInstruction("OP_METHOD", chunk, offset);
+  case OP_ADD_NUM:
+    return quickenedInstruction("OP_ADD_NUM", chunk, offset);
+  case OP_SUBTRACT_NUM:
+    return quickenedInstruction("OP_SUBTRACT_NUM", chunk, offset);
+  case OP_MULTIPLY_NUM:
+    return quickenedInstruction("OP_MULTIPLY_NUM", chunk, offset);
+  case OP_DIVIDE_NUM:
+    return quickenedInstruction("OP_DIVIDE_NUM", chunk, offset);
+  case OP_LESS_NUM:
+    return quickenedInstruction("OP_LESS_NUM", chunk, offset);
+  case OP_GREATER_NUM:
+    return quickenedInstruction("OP_GREATER_NUM", chunk, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
   }
 }
+
+// A superinstruction is printed as its name followed by its first
+// component. The remaining components follow as ordinary instructions.
+static int superInstruction(const char *name, uint8_t first, Chunk *chunk,
+                            int offset)
+{
+  printf("[%s] ", name);
+  return operationInstruction(chunk, offset, first);
+}
+
+int disassembleInstruction(Chunk *chunk, int offset)
+{
+  printf("%04d ", offset);
+
+  LineInfo line = getLineInfo(chunk, offset);
+  printf("[%3d:%3d]\t", line.line, line.column);
+
+  uint8_t instruction = chunk->code[offset];
+  switch (instruction)
+  {
+#define SUPERINSTRUCTION2(name, a, b) \
+  case name:                          \
+    return superInstruction(#name, a, chunk, offset);
+#define SUPERINSTRUCTION3(name, a, b, c) \
+  case name:                             \
+    return superInstruction(#name, a, chunk, offset);
+#include "superinstructions.h"
+#undef SUPERINSTRUCTION2
+#undef SUPERINSTRUCTION3
+  default:
+    return operationInstruction(chunk, offset, instruction);
+  }
+}
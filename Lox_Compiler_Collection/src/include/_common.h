@@ -12,12 +12,20 @@ extern "C" {
 #define NAN_BOXING
 
 extern bool debug;
+extern bool profileOps;
+extern bool gcStats;
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#define DEBUG_PROFILE_OPS
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Labels-as-values is a GNU extension; other compilers keep the switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 struct Chunk;
 
 #ifdef __cplusplus
@@ -6,8 +6,13 @@
 #include "table.h"
 #include "vm/object.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Default limit on call depth; --max-frames overrides it. Each frame gets
+// UINT8_COUNT stack slots.
+#define FRAMES_MAX 4096
+// Bytes each frame has for the closures it keeps off the heap.
+#define FRAME_CLOSURES_MAX 1024
+// Size of the buffer stdout writes through when it is not a terminal.
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,21 +25,74 @@ typedef struct {
 } CallFrame;
 
 typedef struct VM{
-  CallFrame frames[FRAMES_MAX];
+  // The frame array and the value stack are reserved for maxFrames when the
+  // VM starts, but only the pages a program touches are backed by memory.
+  // Neither ever moves, so frame->slots, open upvalues and stackTop stay
+  // valid however deep the program goes.
+  CallFrame* frames;
   int frameCount;
 
-  Value stack[STACK_MAX];
+  Value* stack;
+  Value* stackLimit; // End of the stack. A guard page follows it.
   Value* stackTop;
-  Table globals;
+  // FRAME_CLOSURES_MAX bytes for each frame, reserved like the stack.
+  uint8_t* frameClosures;
+  // Globals are resolved to slots at compile time. A slot holds
+  // UNDEFINED_VAL until its variable has been defined.
+  Table globalSlots;
+  ValueArray globalNames;
+  ValueArray globalValues;
   Table strings;
   ObjString* initString;
+  uint32_t methodEpoch;
   ObjUpvalue* openUpvalues;
   size_t bytesAllocated;
   size_t nextGC;
+  // Under --generational, collections only look at the young objects, those
+  // on objects, allocated since the last collection; survivors move to
+  // oldObjects. Once what survives grows past nextMajorGC, the next
+  // collection looks at both.
+  size_t oldBytes;
+  size_t nextMajorGC;
+  // Objects allocated of each type, and collections run and the time they
+  // took, for --gc-stats.
+  size_t allocations[OBJ_TYPE_COUNT];
+  size_t collections;
+  size_t minorCollections;
+  size_t incrementalSteps;
+  size_t sweepSteps;
+  double gcSeconds;
+  double longestPause;
   Obj* objects;
+  Obj* oldObjects;
+  // Under --lazy-sweep, the objects the last collection marked that are
+  // still to be swept. Objects allocated since go on objects.
+  Obj* unswept;
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
+  // Old objects that may refer to young ones. Under --incremental and
+  // --concurrent, the functions, classes and shapes marking has reached so
+  // far, which are traced again before sweeping.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+  // Under --concurrent, the objects snapshotBarrier() logged and the
+  // memory freed while the marking thread runs, which it may still read.
+  int loggedCount;
+  int loggedCapacity;
+  Obj** logged;
+  int deferredCount;
+  int deferredCapacity;
+  void** deferred;
+  // Under --gc-threads, objects on objects that each start a stretch of
+  // the list one thread sweeps, the one nearest its tail first, and the
+  // objects allocated since the last one.
+  int regionCount;
+  int regionCapacity;
+  Obj** regions;
+  int regionObjects;
+  char output[OUTPUT_BUFFER_SIZE];
 } VM;
 
 typedef enum _InterpretResult {
@@ -43,13 +101,31 @@ typedef enum _InterpretResult {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+// Handed to every native call. Objects a native allocates are reachable
+// from nothing until it returns one as its result, so any it holds across
+// another allocation must go through nativeRoot() first.
+typedef struct NativeContext {
+  char error[256];
+} NativeContext;
+
 extern VM vm;
+// Call depth at which the VM reports "Stack overflow.". Read by initVM().
+extern int maxFrames;
 
 void initVM();
 void freeVM();
+// Writes out what print statements have buffered. The VM flushes before
+// reporting a runtime error and when it is freed.
+void flushOutput();
 InterpretResult interpret(const char* source);
+int globalSlot(ObjString* name);
 void push(Value value);
 Value pop();
+// Keeps value reachable until the native returns, and returns it.
+Value nativeRoot(NativeContext* context, Value value);
+// Records a runtime error for the VM to report once the native returns.
+// Returns false, for natives to return in turn.
+bool nativeError(NativeContext* context, const char* format, ...);
 
 #ifdef __cplusplus
 }
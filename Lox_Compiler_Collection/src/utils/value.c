@@ -1,4 +1,6 @@
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -32,6 +34,32 @@ void freeValueArray(ValueArray *array)
     initValueArray(array);
 }
 
+// Prints number as printf("%g") does. Integers below a million, which most
+// printed numbers are, print in full under %g and need no rounding, so their
+// digits are written directly. NaN fails every comparison, so it is ruled
+// out by comparing with trunc() before anything is cast to int.
+static void printNumber(double number)
+{
+    if (number <= -1e6 || number >= 1e6 || number != trunc(number) ||
+        (number == 0 && signbit(number)))
+    {
+        printf("%g", number);
+        return;
+    }
+
+    char text[8];
+    int start = sizeof(text);
+    int magnitude = abs((int)number);
+    do
+    {
+        text[--start] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (number < 0)
+        text[--start] = '-';
+    fwrite(text + start, 1, sizeof(text) - start, stdout);
+}
+
 void printValue(Value value)
 {
 #ifdef NAN_BOXING
@@ -45,12 +73,16 @@ void printValue(Value value)
     }
     else if (IS_NUMBER(value))
     {
-        printf("%g", AS_NUMBER(value));
+        printNumber(AS_NUMBER(value));
     }
     else if (IS_OBJ(value))
     {
         printObject(value);
     }
+    else if (IS_UNDEFINED(value))
+    {
+        printf("undefined");
+    }
 #else
     switch (value.type)
     {
@@ -61,11 +93,14 @@ void printValue(Value value)
         printf("nil");
         break;
     case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
+        printNumber(AS_NUMBER(value));
         break;
     case VAL_OBJ:
         printObject(value);
         break;
+    case VAL_UNDEFINED:
+        printf("undefined");
+        break;
     }
 #endif
 }
@@ -77,7 +112,10 @@ bool valuesEqual(Value a, Value b)
     {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
-    return a == b;
+    if (a == b)
+        return true;
+    return IS_STRING(a) && IS_STRING(b) &&
+           stringsEqual(AS_STRING(a), AS_STRING(b));
 #else
     if (a.type != b.type)
         return false;
@@ -86,11 +124,14 @@ bool valuesEqual(Value a, Value b)
     case VAL_BOOL:
         return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:
+    case VAL_UNDEFINED:
         return true;
     case VAL_NUMBER:
         return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ:
-        return AS_OBJ(a) == AS_OBJ(b);
+        return AS_OBJ(a) == AS_OBJ(b) ||
+               (IS_STRING(a) && IS_STRING(b) &&
+                stringsEqual(AS_STRING(a), AS_STRING(b)));
     default:
         return false; // Unreachable.
     }
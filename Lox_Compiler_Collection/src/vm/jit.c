@@ -0,0 +1,928 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "vm/jit.h"
+#include "vm/trace.h"
+
+int jitThreshold = -1;
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_SUPPORTED
+#endif
+
+#ifdef JIT_SUPPORTED
+#include <stddef.h>
+#include <sys/mman.h>
+
+// Each instruction becomes one template of x86-64 code. Simple stack and
+// local-slot instructions, jumps and (with NaN boxing) number arithmetic are
+// generated inline; everything else calls the instruction's helper in vm.c.
+// After an instruction that calls or returns, control moves straight to
+// the native code of whichever frame ends up on top, or back to the
+// interpreter if that frame's function has not been compiled.
+//
+// Traces recorded by vm/trace.c are built from the same templates, laid out
+// in the order the recorded instructions ran, with guards on the types,
+// shapes, branches and callees seen while recording. Where a function's
+// template would fall back to a helper, a trace leaves through a side exit.
+//
+// Register use inside generated code:
+//   rbx  the CallFrame being run
+//   r12  &vm.stackTop
+// Both are callee-saved, so they survive helper calls. Nothing else is kept
+// in registers between instructions.
+
+typedef struct
+{
+    int at;     // Position of a rel32 field.
+    int target; // Bytecode offset it jumps to.
+} Fixup;
+
+// A guard's jump to the code that leaves a trace at ip.
+typedef struct
+{
+    int at;
+    uint8_t *ip;
+} SideExit;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+    Fixup *fixups;
+    int fixupCount;
+    int fixupCapacity;
+    int exitOk;
+    int exitError;
+    // Set when compiling a trace: instead of falling back to a helper, the
+    // slow path of an inline template leaves the trace.
+    bool tracing;
+    SideExit *exits;
+    int exitCount;
+    int exitCapacity;
+} Assembler;
+
+#define IP_DISP ((uint8_t)offsetof(CallFrame, ip))
+#define SLOTS_DISP ((uint8_t)offsetof(CallFrame, slots))
+
+#define JMP 0xE9
+#define JE 0x84
+#define JNE 0x85
+
+static void emitByte(Assembler *as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc(as->code, as->capacity);
+        if (as->code == NULL)
+            exit(1);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler *as, const uint8_t *bytes, int count)
+{
+    for (int i = 0; i < count; i++)
+        emitByte(as, bytes[i]);
+}
+
+#define EMIT(...)                                  \
+    emitBytes(as, (const uint8_t[]){__VA_ARGS__},  \
+              sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Assembler *as, int at, int target)
+{
+    uint32_t rel = (uint32_t)(target - (at + 4));
+    for (int i = 0; i < 4; i++)
+        as->code[at + i] = (uint8_t)(rel >> (8 * i));
+}
+
+// Emits a jmp or jcc with a rel32 operand and returns the operand's position.
+static int emitJump(Assembler *as, uint8_t kind)
+{
+    if (kind == JMP)
+        EMIT(JMP);
+    else
+        EMIT(0x0F, kind);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+static void emitJumpTo(Assembler *as, uint8_t kind, int target)
+{
+    patch32(as, emitJump(as, kind), target);
+}
+
+static void patchHere(Assembler *as, int at)
+{
+    patch32(as, at, as->count);
+}
+
+static void emitJumpToInstruction(Assembler *as, uint8_t kind, int target)
+{
+    int at = emitJump(as, kind);
+    if (as->fixupCapacity < as->fixupCount + 1)
+    {
+        as->fixupCapacity = as->fixupCapacity < 16 ? 16 : as->fixupCapacity * 2;
+        as->fixups = realloc(as->fixups, sizeof(Fixup) * as->fixupCapacity);
+        if (as->fixups == NULL)
+            exit(1);
+    }
+    as->fixups[as->fixupCount++] = (Fixup){at, target};
+}
+
+static void addSideExit(Assembler *as, int at, uint8_t *ip)
+{
+    if (as->exitCapacity < as->exitCount + 1)
+    {
+        as->exitCapacity = as->exitCapacity < 16 ? 16 : as->exitCapacity * 2;
+        as->exits = realloc(as->exits, sizeof(SideExit) * as->exitCapacity);
+        if (as->exits == NULL)
+            exit(1);
+    }
+    as->exits[as->exitCount++] = (SideExit){at, ip};
+}
+
+static void freeAssembler(Assembler *as)
+{
+    free(as->code);
+    free(as->fixups);
+    free(as->exits);
+}
+
+static void emitPrologue(Assembler *as)
+{
+    EMIT(0x53);                   // push rbx
+    EMIT(0x41, 0x54);             // push r12
+    EMIT(0x41, 0x55);             // push r13, keeps rsp 16-byte aligned
+    EMIT(0x48, 0x89, 0xFB);       // mov rbx, rdi
+    EMIT(0x49, 0xBC);             // mov r12, &vm.stackTop
+    emit64(as, (uint64_t)(uintptr_t)&vm.stackTop);
+    EMIT(0xFF, 0xE6);             // jmp rsi
+
+    as->exitOk = as->count;
+    EMIT(0x31, 0xC0);             // xor eax, eax
+    EMIT(0x41, 0x5D);             // pop r13
+    EMIT(0x41, 0x5C);             // pop r12
+    EMIT(0x5B);                   // pop rbx
+    EMIT(0xC3);                   // ret
+
+    as->exitError = as->count;
+    EMIT(0xB8);                   // mov eax, INTERPRET_RUNTIME_ERROR
+    emit32(as, INTERPRET_RUNTIME_ERROR);
+    EMIT(0x41, 0x5D);             // pop r13
+    EMIT(0x41, 0x5C);             // pop r12
+    EMIT(0x5B);                   // pop rbx
+    EMIT(0xC3);                   // ret
+}
+
+typedef struct
+{
+    CallFrame *frame;
+    void *entry;
+} JitResume;
+
+// Returned in rax:rdx, so the generated code can switch frames without
+// leaving native code.
+static JitResume jitResume()
+{
+    JitResume resume = {NULL, NULL};
+    if (vm.frameCount > 0)
+    {
+        resume.frame = &vm.frames[vm.frameCount - 1];
+        resume.entry = jitEntry(resume.frame);
+    }
+    return resume;
+}
+
+// Stores the operand address of the instruction at offset in frame->ip and
+// calls its helper, leaving native code if the helper reports an error.
+static void emitHelperCall(Assembler *as, Chunk *chunk, int offset,
+                           uint8_t op)
+{
+    EMIT(0x48, 0xB8);             // mov rax, operands
+    emit64(as, (uint64_t)(uintptr_t)(chunk->code + offset + 1));
+    EMIT(0x48, 0x89, 0x43, IP_DISP); // mov [rbx + ip], rax
+    EMIT(0x48, 0x89, 0xDF);       // mov rdi, rbx
+    EMIT(0x48, 0xB8);             // mov rax, helper
+    emit64(as, (uint64_t)(uintptr_t)jitHelpers[op]);
+    EMIT(0xFF, 0xD0);             // call rax
+    EMIT(0x85, 0xC0);             // test eax, eax
+    emitJumpTo(as, JNE, as->exitError);
+}
+
+// Emits what runs when the inline template for the instruction at offset
+// takes one of the given rel32 jumps: the instruction's helper in a
+// function, or a side exit in a trace.
+static void emitSlowPath(Assembler *as, Chunk *chunk, int offset, uint8_t op,
+                         const int *jumps, int jumpCount)
+{
+    if (as->tracing)
+    {
+        for (int i = 0; i < jumpCount; i++)
+            addSideExit(as, jumps[i], chunk->code + offset);
+        return;
+    }
+
+    int done = emitJump(as, JMP);
+    for (int i = 0; i < jumpCount; i++)
+        patchHere(as, jumps[i]);
+    emitHelperCall(as, chunk, offset, op);
+    patchHere(as, done);
+}
+
+#ifdef NAN_BOXING
+// Pushes rax.
+static void emitPush(Assembler *as)
+{
+    EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+    EMIT(0x48, 0x89, 0x01);       // mov [rcx], rax
+    EMIT(0x49, 0x83, 0x04, 0x24, 0x08); // add qword [r12], 8
+}
+
+static void emitPushConstant(Assembler *as, Value value)
+{
+    EMIT(0x48, 0xB8);             // mov rax, value
+    emit64(as, value);
+    emitPush(as);
+}
+
+// Loads the two topmost values into rax (left) and rdx (right), with rcx
+// holding vm.stackTop, and jumps to the returned rel32 fields unless both
+// are numbers.
+static void emitLoadNumbers(Assembler *as, int *notNumber)
+{
+    EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+    EMIT(0x48, 0x8B, 0x41, 0xF0); // mov rax, [rcx - 16]
+    EMIT(0x48, 0x8B, 0x51, 0xF8); // mov rdx, [rcx - 8]
+    EMIT(0x48, 0xBE);             // mov rsi, QNAN
+    emit64(as, QNAN);
+    EMIT(0x48, 0x89, 0xC7);       // mov rdi, rax
+    EMIT(0x48, 0x21, 0xF7);       // and rdi, rsi
+    EMIT(0x48, 0x39, 0xF7);       // cmp rdi, rsi
+    notNumber[0] = emitJump(as, JE);
+    EMIT(0x48, 0x89, 0xD7);       // mov rdi, rdx
+    EMIT(0x48, 0x21, 0xF7);       // and rdi, rsi
+    EMIT(0x48, 0x39, 0xF7);       // cmp rdi, rsi
+    notNumber[1] = emitJump(as, JE);
+    EMIT(0x66, 0x48, 0x0F, 0x6E, 0xC0); // movq xmm0, rax
+    EMIT(0x66, 0x48, 0x0F, 0x6E, 0xCA); // movq xmm1, rdx
+}
+
+// Turns the flag in al into a Lox bool in rax.
+static void emitBoolFromAl(Assembler *as)
+{
+    EMIT(0x0F, 0xB6, 0xC0);       // movzx eax, al
+    EMIT(0x48, 0xBA);             // mov rdx, FALSE_VAL
+    emit64(as, FALSE_VAL);
+    EMIT(0x48, 0x01, 0xD0);       // add rax, rdx
+}
+
+// Replaces the two topmost values with rax.
+static void emitStoreBinaryResult(Assembler *as)
+{
+    EMIT(0x48, 0x89, 0x41, 0xF0); // mov [rcx - 16], rax
+    EMIT(0x49, 0x83, 0x2C, 0x24, 0x08); // sub qword [r12], 8
+}
+
+// Number arithmetic and comparisons inline, with the helper as slow path
+// for strings and type errors.
+static void emitNumberBinary(Assembler *as, Chunk *chunk, int offset,
+                             uint8_t op)
+{
+    int notNumber[2];
+    emitLoadNumbers(as, notNumber);
+    switch (op)
+    {
+    case OP_ADD:
+        EMIT(0xF2, 0x0F, 0x58, 0xC1); // addsd xmm0, xmm1
+        break;
+    case OP_SUBTRACT:
+        EMIT(0xF2, 0x0F, 0x5C, 0xC1); // subsd xmm0, xmm1
+        break;
+    case OP_MULTIPLY:
+        EMIT(0xF2, 0x0F, 0x59, 0xC1); // mulsd xmm0, xmm1
+        break;
+    case OP_DIVIDE:
+        EMIT(0xF2, 0x0F, 0x5E, 0xC1); // divsd xmm0, xmm1
+        break;
+    case OP_LESS:
+        EMIT(0x66, 0x0F, 0x2E, 0xC8); // ucomisd xmm1, xmm0
+        EMIT(0x0F, 0x97, 0xC0);       // seta al
+        break;
+    case OP_GREATER:
+        EMIT(0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+        EMIT(0x0F, 0x97, 0xC0);       // seta al
+        break;
+    }
+    if (op == OP_LESS || op == OP_GREATER)
+        emitBoolFromAl(as);
+    else
+        EMIT(0x66, 0x48, 0x0F, 0x7E, 0xC0); // movq rax, xmm0
+    emitStoreBinaryResult(as);
+    emitSlowPath(as, chunk, offset, op, notNumber, 2);
+}
+
+// Loads vm.globalValues.values into rax. The array moves as globals are
+// added, so it is not baked into the code.
+static void emitLoadGlobals(Assembler *as)
+{
+    EMIT(0x48, 0xB8);             // mov rax, &vm.globalValues.values
+    emit64(as, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    EMIT(0x48, 0x8B, 0x00);       // mov rax, [rax]
+}
+
+// Global reads and writes inline, with the slow path dealing with undefined
+// variables.
+static void emitGlobal(Assembler *as, Chunk *chunk, int offset, uint8_t op,
+                       uint32_t slot)
+{
+    emitLoadGlobals(as);
+    if (op == OP_DEFINE_GLOBAL || op == OP_DEFINE_GLOBAL_LONG)
+    {
+        EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+        EMIT(0x48, 0x8B, 0x51, 0xF8); // mov rdx, [rcx - 8]
+        EMIT(0x48, 0x89, 0x90);       // mov [rax + slot], rdx
+        emit32(as, slot * sizeof(Value));
+        EMIT(0x49, 0x83, 0x2C, 0x24, 0x08); // sub qword [r12], 8
+        return;
+    }
+
+    EMIT(0x48, 0xBA);             // mov rdx, UNDEFINED_VAL
+    emit64(as, UNDEFINED_VAL);
+    EMIT(0x48, 0x39, 0x90);       // cmp [rax + slot], rdx
+    emit32(as, slot * sizeof(Value));
+    int undefined = emitJump(as, JE);
+    if (op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG)
+    {
+        EMIT(0x48, 0x8B, 0x80);   // mov rax, [rax + slot]
+        emit32(as, slot * sizeof(Value));
+        emitPush(as);
+    }
+    else
+    {
+        EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+        EMIT(0x48, 0x8B, 0x51, 0xF8); // mov rdx, [rcx - 8]
+        EMIT(0x48, 0x89, 0x90);       // mov [rax + slot], rdx
+        emit32(as, slot * sizeof(Value));
+    }
+    emitSlowPath(as, chunk, offset, op, &undefined, 1);
+}
+
+static void emitEqual(Assembler *as)
+{
+    int notNumber[2];
+    emitLoadNumbers(as, notNumber);
+    EMIT(0x66, 0x0F, 0x2E, 0xC1); // ucomisd xmm0, xmm1
+    EMIT(0x0F, 0x94, 0xC0);       // sete al
+    EMIT(0x0F, 0x9B, 0xC2);       // setnp dl
+    EMIT(0x20, 0xD0);             // and al, dl
+    int store = emitJump(as, JMP);
+
+    // Other values are equal when their bits are, except for strings that
+    // are not interned yet: objects with different bits ask valuesEqual.
+    // Both operands are still on the stack for the collector.
+    patchHere(as, notNumber[0]);
+    patchHere(as, notNumber[1]);
+    EMIT(0x48, 0x89, 0xC7);       // mov rdi, rax
+    EMIT(0x48, 0x89, 0xD6);       // mov rsi, rdx
+    EMIT(0x48, 0x39, 0xF7);       // cmp rdi, rsi
+    EMIT(0x0F, 0x94, 0xC0);       // sete al
+    int same = emitJump(as, JE);
+    EMIT(0x48, 0xB9);             // mov rcx, SIGN_BIT | QNAN
+    emit64(as, SIGN_BIT | QNAN);
+    EMIT(0x48, 0x21, 0xCA);       // and rdx, rcx
+    EMIT(0x48, 0x39, 0xCA);       // cmp rdx, rcx
+    int notObject = emitJump(as, JNE);
+    EMIT(0x48, 0xB8);             // mov rax, valuesEqual
+    emit64(as, (uint64_t)(uintptr_t)valuesEqual);
+    EMIT(0xFF, 0xD0);             // call rax
+
+    patchHere(as, store);
+    patchHere(as, same);
+    patchHere(as, notObject);
+    EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+    emitBoolFromAl(as);
+    emitStoreBinaryResult(as);
+}
+#endif
+
+static void emitInstruction(Assembler *as, Chunk *chunk, int offset,
+                            uint8_t op)
+{
+    uint8_t *code = chunk->code + offset;
+    switch (op)
+    {
+    case OP_JUMP:
+    case OP_LOOP:
+    {
+        int jump = (code[1] << 8) | code[2];
+        int target = offset + 3 + (op == OP_LOOP ? -jump : jump);
+        emitJumpToInstruction(as, JMP, target);
+        return;
+    }
+    case OP_JUMP_IF_FALSE:
+    {
+        int target = offset + 3 + ((code[1] << 8) | code[2]);
+#ifdef NAN_BOXING
+        EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+        EMIT(0x48, 0x8B, 0x41, 0xF8); // mov rax, [rcx - 8]
+        EMIT(0x48, 0xBA);             // mov rdx, FALSE_VAL
+        emit64(as, FALSE_VAL);
+        EMIT(0x48, 0x39, 0xD0);       // cmp rax, rdx
+        emitJumpToInstruction(as, JE, target);
+        EMIT(0x48, 0xBA);             // mov rdx, NIL_VAL
+        emit64(as, NIL_VAL);
+        EMIT(0x48, 0x39, 0xD0);       // cmp rax, rdx
+        emitJumpToInstruction(as, JE, target);
+#else
+        EMIT(0x48, 0xB8);             // mov rax, jitPeekFalsey
+        emit64(as, (uint64_t)(uintptr_t)jitPeekFalsey);
+        EMIT(0xFF, 0xD0);             // call rax
+        EMIT(0x84, 0xC0);             // test al, al
+        emitJumpToInstruction(as, JNE, target);
+#endif
+        return;
+    }
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+    case OP_RETURN:
+        emitHelperCall(as, chunk, offset, op);
+        EMIT(0x48, 0xB8);             // mov rax, jitResume
+        emit64(as, (uint64_t)(uintptr_t)jitResume);
+        EMIT(0xFF, 0xD0);             // call rax
+        EMIT(0x48, 0x85, 0xD2);       // test rdx, rdx
+        emitJumpTo(as, JE, as->exitOk);
+        EMIT(0x48, 0x89, 0xC3);       // mov rbx, rax
+        EMIT(0xFF, 0xE2);             // jmp rdx
+        return;
+#ifdef NAN_BOXING
+    case OP_CONSTANT:
+        emitPushConstant(as, chunk->constants.values[code[1]]);
+        return;
+    case OP_CONSTANT_LONG:
+        emitPushConstant(as, chunk->constants.values[(code[1] << 16) |
+                                                     (code[2] << 8) | code[3]]);
+        return;
+    case OP_NIL:
+        emitPushConstant(as, NIL_VAL);
+        return;
+    case OP_TRUE:
+        emitPushConstant(as, TRUE_VAL);
+        return;
+    case OP_FALSE:
+        emitPushConstant(as, FALSE_VAL);
+        return;
+    case OP_POP:
+        EMIT(0x49, 0x83, 0x2C, 0x24, 0x08); // sub qword [r12], 8
+        return;
+    case OP_GET_LOCAL:
+        EMIT(0x48, 0x8B, 0x43, SLOTS_DISP); // mov rax, [rbx + slots]
+        EMIT(0x48, 0x8B, 0x80);             // mov rax, [rax + slot]
+        emit32(as, code[1] * sizeof(Value));
+        emitPush(as);
+        return;
+    case OP_SET_LOCAL:
+        EMIT(0x49, 0x8B, 0x0C, 0x24);       // mov rcx, [r12]
+        EMIT(0x48, 0x8B, 0x51, 0xF8);       // mov rdx, [rcx - 8]
+        EMIT(0x48, 0x8B, 0x43, SLOTS_DISP); // mov rax, [rbx + slots]
+        EMIT(0x48, 0x89, 0x90);             // mov [rax + slot], rdx
+        emit32(as, code[1] * sizeof(Value));
+        return;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+        emitGlobal(as, chunk, offset, op, code[1]);
+        return;
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+        emitGlobal(as, chunk, offset, op,
+                   (code[1] << 16) | (code[2] << 8) | code[3]);
+        return;
+    case OP_EQUAL:
+        emitEqual(as);
+        return;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+        emitNumberBinary(as, chunk, offset, op);
+        return;
+#endif
+    default:
+        emitHelperCall(as, chunk, offset, op);
+        return;
+    }
+}
+
+bool jitSupports(uint8_t op)
+{
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP ||
+           jitHelpers[op] != NULL;
+}
+
+// Copies the assembled code into executable memory, or returns NULL.
+static uint8_t *installCode(Assembler *as)
+{
+    uint8_t *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return NULL;
+    memcpy(code, as->code, as->count);
+    mprotect(code, as->count, PROT_READ | PROT_EXEC);
+    return code;
+}
+
+bool jitCompile(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        if (!jitSupports(baseOpcode(chunk, offset)))
+        {
+            function->callCount = -1;
+            return false;
+        }
+    }
+
+    Assembler as = {0};
+    int *native = malloc(sizeof(int) * chunk->count);
+    if (native == NULL)
+        exit(1);
+    for (int i = 0; i < chunk->count; i++)
+        native[i] = -1;
+
+    emitPrologue(&as);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset))
+    {
+        native[offset] = as.count;
+        emitInstruction(&as, chunk, offset, baseOpcode(chunk, offset));
+    }
+    for (int i = 0; i < as.fixupCount; i++)
+    {
+        patch32(&as, as.fixups[i].at, native[as.fixups[i].target]);
+    }
+
+    uint8_t *code = installCode(&as);
+    if (code == NULL)
+    {
+        free(native);
+        freeAssembler(&as);
+        function->callCount = -1;
+        return false;
+    }
+
+    JitCode *jit = malloc(sizeof(JitCode));
+    void **entries = calloc(chunk->count, sizeof(void *));
+    if (jit == NULL || entries == NULL)
+        exit(1);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        if (native[i] >= 0)
+            entries[i] = code + native[i];
+    }
+    jit->code = code;
+    jit->size = as.count;
+    jit->entries = entries;
+    function->jit = jit;
+
+    free(native);
+    freeAssembler(&as);
+    return true;
+}
+
+void jitFree(JitCode *jit)
+{
+    munmap(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+typedef InterpretResult (*NativeCode)(CallFrame *frame, void *entry);
+
+InterpretResult jitRun(CallFrame *frame, void *entry)
+{
+    NativeCode native;
+    uint8_t *code = frame->closure->function->jit->code;
+    memcpy(&native, &code, sizeof(native));
+    return native(frame, entry);
+}
+
+// Returns the frame on top after a call or return inside a trace.
+static CallFrame *topFrame()
+{
+    return &vm.frames[vm.frameCount - 1];
+}
+
+#define CLOSURE_DISP ((uint8_t)offsetof(CallFrame, closure))
+#define FUNCTION_DISP ((uint8_t)offsetof(ObjClosure, function))
+
+// Switches rbx to the frame on top, leaving the trace unless it runs
+// function. The VM is already consistent at that point, so the exit does
+// not need to store ip.
+static void emitFrameGuard(Assembler *as, ObjFunction *function)
+{
+    EMIT(0x48, 0xB8);             // mov rax, topFrame
+    emit64(as, (uint64_t)(uintptr_t)topFrame);
+    EMIT(0xFF, 0xD0);             // call rax
+    EMIT(0x48, 0x8B, 0x48, CLOSURE_DISP);  // mov rcx, [rax + closure]
+    EMIT(0x48, 0x8B, 0x49, FUNCTION_DISP); // mov rcx, [rcx + function]
+    EMIT(0x48, 0xBA);             // mov rdx, function
+    emit64(as, (uint64_t)(uintptr_t)function);
+    EMIT(0x48, 0x39, 0xD1);       // cmp rcx, rdx
+    emitJumpTo(as, JNE, as->exitOk);
+    EMIT(0x48, 0x89, 0xC3);       // mov rbx, rax
+}
+
+static void emitBranchGuard(Assembler *as, TraceStep *step, uint8_t *ip)
+{
+#ifdef NAN_BOXING
+    EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+    EMIT(0x48, 0x8B, 0x41, 0xF8); // mov rax, [rcx - 8]
+    EMIT(0x48, 0xBA);             // mov rdx, FALSE_VAL
+    emit64(as, FALSE_VAL);
+    EMIT(0x48, 0x39, 0xD0);       // cmp rax, rdx
+    if (step->taken)
+    {
+        int isFalse = emitJump(as, JE);
+        EMIT(0x48, 0xBA);         // mov rdx, NIL_VAL
+        emit64(as, NIL_VAL);
+        EMIT(0x48, 0x39, 0xD0);   // cmp rax, rdx
+        addSideExit(as, emitJump(as, JNE), ip);
+        patchHere(as, isFalse);
+    }
+    else
+    {
+        addSideExit(as, emitJump(as, JE), ip);
+        EMIT(0x48, 0xBA);         // mov rdx, NIL_VAL
+        emit64(as, NIL_VAL);
+        EMIT(0x48, 0x39, 0xD0);   // cmp rax, rdx
+        addSideExit(as, emitJump(as, JE), ip);
+    }
+#else
+    EMIT(0x48, 0xB8);             // mov rax, jitPeekFalsey
+    emit64(as, (uint64_t)(uintptr_t)jitPeekFalsey);
+    EMIT(0xFF, 0xD0);             // call rax
+    EMIT(0x84, 0xC0);             // test al, al
+    addSideExit(as, emitJump(as, step->taken ? JE : JNE), ip);
+#endif
+}
+
+#ifdef NAN_BOXING
+#define TYPE_DISP ((uint8_t)offsetof(Obj, type))
+#define SHAPE_DISP ((uint8_t)offsetof(ObjInstance, shape))
+#define FIELDS_DISP ((uint8_t)offsetof(ObjInstance, slots))
+#define MARKED_DISP ((uint8_t)offsetof(Obj, isMarked))
+#define OLD_DISP ((uint8_t)offsetof(Obj, isOld))
+#define REMEMBERED_DISP ((uint8_t)offsetof(Obj, isRemembered))
+
+// Leaves the trace unless rax holds an instance with the given shape, and
+// turns rax into the ObjInstance pointer. rcx is preserved.
+static void emitShapeGuard(Assembler *as, ObjShape *shape, uint8_t *ip)
+{
+    EMIT(0x48, 0xBA);             // mov rdx, QNAN | SIGN_BIT
+    emit64(as, QNAN | SIGN_BIT);
+    EMIT(0x48, 0x89, 0xC6);       // mov rsi, rax
+    EMIT(0x48, 0x21, 0xD6);       // and rsi, rdx
+    EMIT(0x48, 0x39, 0xD6);       // cmp rsi, rdx
+    addSideExit(as, emitJump(as, JNE), ip);
+    EMIT(0x48, 0xF7, 0xD2);       // not rdx
+    EMIT(0x48, 0x21, 0xD0);       // and rax, rdx
+    EMIT(0x83, 0x78, TYPE_DISP, OBJ_INSTANCE); // cmp dword [rax + type], imm8
+    addSideExit(as, emitJump(as, JNE), ip);
+    EMIT(0x48, 0xBA);             // mov rdx, shape
+    emit64(as, (uint64_t)(uintptr_t)shape);
+    EMIT(0x48, 0x39, 0x50, SHAPE_DISP); // cmp [rax + shape], rdx
+    addSideExit(as, emitJump(as, JNE), ip);
+}
+
+static void emitGetField(Assembler *as, TraceStep *step, uint8_t *ip)
+{
+    EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+    EMIT(0x48, 0x8B, 0x41, 0xF8); // mov rax, [rcx - 8]
+    emitShapeGuard(as, step->shape, ip);
+    EMIT(0x48, 0x8B, 0x40, FIELDS_DISP); // mov rax, [rax + slots]
+    EMIT(0x48, 0x8B, 0x80);       // mov rax, [rax + slot]
+    emit32(as, step->slot * sizeof(Value));
+    EMIT(0x48, 0x89, 0x41, 0xF8); // mov [rcx - 8], rax
+}
+
+static void emitSetField(Assembler *as, TraceStep *step, uint8_t *ip)
+{
+    EMIT(0x49, 0x8B, 0x0C, 0x24); // mov rcx, [r12]
+    EMIT(0x48, 0x8B, 0x41, 0xF0); // mov rax, [rcx - 16]
+    emitShapeGuard(as, step->shape, ip);
+    EMIT(0x48, 0x8B, 0x51, 0xF8); // mov rdx, [rcx - 8]
+    // Storing an object into an old instance that is not remembered, or
+    // into a marked one while a collection is marking, is left to the
+    // interpreter, which takes the write barrier. So is every store while
+    // the marking thread runs, which needs the value overwritten.
+    EMIT(0x48, 0xBE);             // mov rsi, &gcConcurrentMarking
+    emit64(as, (uint64_t)(uintptr_t)&gcConcurrentMarking);
+    EMIT(0x80, 0x3E, 0x00);       // cmp byte [rsi], 0
+    addSideExit(as, emitJump(as, JNE), ip);
+    EMIT(0x48, 0xBE);             // mov rsi, &gcMarking
+    emit64(as, (uint64_t)(uintptr_t)&gcMarking);
+    EMIT(0x80, 0x3E, 0x00);       // cmp byte [rsi], 0
+    int notMarking = emitJump(as, JE);
+    EMIT(0x80, 0x78, MARKED_DISP, 0x00); // cmp byte [rax + isMarked], 0
+    int marked = emitJump(as, JNE);
+    patchHere(as, notMarking);
+    EMIT(0x80, 0x78, OLD_DISP, 0x00); // cmp byte [rax + isOld], 0
+    int young = emitJump(as, JE);
+    EMIT(0x80, 0x78, REMEMBERED_DISP, 0x00); // cmp byte [rax + remembered], 0
+    int remembered = emitJump(as, JNE);
+    patchHere(as, marked);
+    EMIT(0x48, 0xBE);             // mov rsi, QNAN | SIGN_BIT
+    emit64(as, QNAN | SIGN_BIT);
+    EMIT(0x48, 0x89, 0xD7);       // mov rdi, rdx
+    EMIT(0x48, 0x21, 0xF7);       // and rdi, rsi
+    EMIT(0x48, 0x39, 0xF7);       // cmp rdi, rsi
+    addSideExit(as, emitJump(as, JE), ip);
+    patchHere(as, young);
+    patchHere(as, remembered);
+    EMIT(0x48, 0x8B, 0x40, FIELDS_DISP); // mov rax, [rax + slots]
+    EMIT(0x48, 0x89, 0x90);       // mov [rax + slot], rdx
+    emit32(as, step->slot * sizeof(Value));
+    EMIT(0x48, 0x89, 0x51, 0xF0); // mov [rcx - 16], rdx
+    EMIT(0x49, 0x83, 0x2C, 0x24, 0x08); // sub qword [r12], 8
+}
+#endif
+
+static void emitTraceStep(Assembler *as, Trace *trace, int index, int loop)
+{
+    TraceStep *step = &trace->steps[index];
+    Chunk *chunk = &step->function->chunk;
+    uint8_t *ip = chunk->code + step->offset;
+    switch (step->op)
+    {
+    case OP_JUMP:
+        // The trace is already laid out in the order it ran.
+        return;
+    case OP_JUMP_IF_FALSE:
+        emitBranchGuard(as, step, ip);
+        return;
+    case OP_LOOP:
+        // Only the last step jumps back to the top of the trace; any other
+        // back-edge is laid out in line like OP_JUMP.
+        if (index < trace->stepCount - 1)
+            return;
+        EMIT(0x48, 0xB8);         // mov rax, &trace->iterations
+        emit64(as, (uint64_t)(uintptr_t)&trace->iterations);
+        EMIT(0x48, 0xFF, 0x00);   // inc qword [rax]
+        emitJumpTo(as, JMP, loop);
+        return;
+    case OP_CALL:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_CALL:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+    case OP_RETURN:
+        // The callee's or caller's instructions follow in the trace.
+        emitHelperCall(as, chunk, step->offset, step->op);
+        emitFrameGuard(as, trace->steps[index + 1].function);
+        return;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_LESS:
+    case OP_GREATER:
+        if (!step->taken)
+        {
+            emitHelperCall(as, chunk, step->offset, step->op);
+            return;
+        }
+        break;
+#ifdef NAN_BOXING
+    case OP_GET_PROPERTY:
+        if (step->shape != NULL)
+        {
+            emitGetField(as, step, ip);
+            return;
+        }
+        break;
+    case OP_SET_PROPERTY:
+        if (step->shape != NULL)
+        {
+            emitSetField(as, step, ip);
+            return;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    emitInstruction(as, chunk, step->offset, step->op);
+}
+
+// Side exits go after the loop, out of the way of the hot path.
+static void emitSideExits(Assembler *as)
+{
+    for (int i = 0; i < as->exitCount; i++)
+    {
+        patchHere(as, as->exits[i].at);
+        EMIT(0x48, 0xB8);         // mov rax, ip
+        emit64(as, (uint64_t)(uintptr_t)as->exits[i].ip);
+        EMIT(0x48, 0x89, 0x43, IP_DISP); // mov [rbx + ip], rax
+        emitJumpTo(as, JMP, as->exitOk);
+    }
+}
+
+bool jitCompileTrace(Trace *trace)
+{
+    Assembler as = {0};
+    as.tracing = true;
+    emitPrologue(&as);
+    int loop = as.count;
+    for (int i = 0; i < trace->stepCount; i++)
+        emitTraceStep(&as, trace, i, loop);
+
+    emitSideExits(&as);
+
+    uint8_t *code = installCode(&as);
+    freeAssembler(&as);
+    if (code == NULL)
+        return false;
+    trace->code = code;
+    trace->size = as.count;
+    trace->entry = code + loop;
+    return true;
+}
+
+void jitFreeTrace(Trace *trace)
+{
+    munmap(trace->code, trace->size);
+    trace->code = NULL;
+    trace->entry = NULL;
+}
+
+InterpretResult jitRunTrace(Trace *trace, CallFrame *frame)
+{
+    NativeCode native;
+    memcpy(&native, &trace->code, sizeof(native));
+    return native(frame, trace->entry);
+}
+
+#else
+
+bool jitCompile(ObjFunction *function)
+{
+    function->callCount = -1;
+    return false;
+}
+
+void jitFree(JitCode *jit)
+{
+}
+
+InterpretResult jitRun(CallFrame *frame, void *entry)
+{
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+bool jitSupports(uint8_t op)
+{
+    return false;
+}
+
+bool jitCompileTrace(Trace *trace)
+{
+    return false;
+}
+
+void jitFreeTrace(Trace *trace)
+{
+}
+
+InterpretResult jitRunTrace(Trace *trace, CallFrame *frame)
+{
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+#endif
@@ -30,5 +30,8 @@ tools = [
 ]
 
 llvm_config.add_tool_substitutions(tools, tool_dirs)
-config.substitutions.append(("%lox", os.path.join(config.lox_build_path, "bin", config.lox_bin_name)))
+# Extra interpreter flags, e.g. `--param lox_flags=--jit-all` to run the
+# whole suite with every function compiled.
+lox_flags = lit_config.params.get("lox_flags", "")
+config.substitutions.append(("%lox", " ".join(filter(None, [os.path.join(config.lox_build_path, "bin", config.lox_bin_name), lox_flags]))))
 config.substitutions.append(("%parser", os.path.join(config.lox_build_path, "bin", "lox-parser")))
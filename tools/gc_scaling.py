@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Measure how the stop-the-world collector scales with --gc-threads.
+
+Runs a clox binary over a benchmark with --gc-threads 1 up to --max-threads
+(the machine's cores by default) and --gc-stats, and prints the wall time,
+the time spent in collections, the longest pause and the speedup of the
+collections over one thread. Each setting runs --runs times and the best
+run is kept.
+
+    tools/gc_scaling.py --clox CLox/build/bin/clox
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+GC_TIME = re.compile(r"gc time: ([0-9.]+) ms, longest pause ([0-9.]+) ms")
+
+
+def run(clox, script, threads):
+    start = time.monotonic()
+    result = subprocess.run(
+        [clox, script, "--gc-stats", "--gc-threads", str(threads)],
+        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    wall = time.monotonic() - start
+    if result.returncode != 0:
+        sys.exit("%s failed with --gc-threads %d:\n%s"
+                 % (script, threads, result.stderr))
+    match = GC_TIME.search(result.stderr)
+    if match is None:
+        sys.exit("no --gc-stats output from %s" % clox)
+    return wall, float(match.group(1)), float(match.group(2))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--clox", required=True, help="clox binary to run")
+    parser.add_argument("--script",
+                        default=os.path.join(ROOT, "benchmark",
+                                             "binary_trees.lox"),
+                        help="Lox script to collect for")
+    parser.add_argument("--max-threads", type=int,
+                        default=os.cpu_count() or 1)
+    parser.add_argument("--runs", type=int, default=3)
+    args = parser.parse_args()
+
+    print("threads     wall   gc time   longest pause   gc speedup")
+    base = None
+    for threads in range(1, args.max_threads + 1):
+        best = min((run(args.clox, args.script, threads)
+                    for _ in range(args.runs)), key=lambda r: r[1])
+        wall, gc, pause = best
+        if base is None:
+            base = gc
+        print("%7d  %6.2fs  %6.0fms  %12.2fms  %10.2fx"
+              % (threads, wall, gc, pause, base / gc))
+
+
+if __name__ == "__main__":
+    main()
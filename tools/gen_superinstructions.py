@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Regenerate superinstructions.h from an opcode profile.
+
+Runs a clox binary with --profile-ops over a corpus of Lox scripts (the
+benchmarks and the interpreter tests by default), ranks the instruction
+pairs and triples it reports by the dispatches fusing them would save, and
+writes the best ones as an X-macro header for CLox and the Lox Compiler
+Collection runtime.
+
+Candidates are ranked by the number of dispatches they would have saved
+over the corpus. A script that executes more than --cap instructions is
+scaled down to that many, so the hot loops of the benchmarks outweigh
+straight-line test scripts without one benchmark deciding everything.
+
+    tools/gen_superinstructions.py --clox CLox/build/bin/clox
+"""
+
+import argparse
+import collections
+import glob
+import os
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+OUTPUTS = [
+    os.path.join(ROOT, "CLox", "src", "include", "superinstructions.h"),
+    os.path.join(ROOT, "Lox_Compiler_Collection", "src", "include",
+                 "superinstructions.h"),
+]
+# Opcodes are a byte and the VM already uses a few dozen of them.
+MAX_SUPERINSTRUCTIONS = 64
+
+
+def default_corpus():
+    files = sorted(glob.glob(os.path.join(ROOT, "benchmark", "*.lox")))
+    files += sorted(glob.glob(os.path.join(ROOT, "tests", "interpreter", "**",
+                                           "*.lox"), recursive=True))
+    return files
+
+
+def profile(clox, path, timeout):
+    try:
+        result = subprocess.run([clox, path, "--profile-ops"],
+                                stdout=subprocess.DEVNULL,
+                                stderr=subprocess.PIPE,
+                                timeout=timeout)
+    except subprocess.TimeoutExpired:
+        print("skipped %s: timed out" % path, file=sys.stderr)
+        return None
+
+    executed = 0
+    counts = {}
+    for line in result.stderr.decode(errors="replace").splitlines():
+        fields = line.split()
+        if fields[:1] == ["executed"]:
+            executed = int(fields[1])
+        elif fields[:1] in (["pair"], ["triple"]):
+            counts[tuple(fields[2:])] = int(fields[1])
+    return executed, counts
+
+
+def name_of(ops):
+    return "OP_" + "_".join(op[len("OP_"):] for op in ops)
+
+
+def write_header(path, chosen, corpus_size):
+    lines = [
+        "// Generated by tools/gen_superinstructions.py from an opcode profile",
+        "// of %d scripts. Do not edit; rerun the script instead." % corpus_size,
+        "//",
+        "// SUPERINSTRUCTION2(name, first, second)",
+        "// SUPERINSTRUCTION3(name, first, second, third)",
+        "",
+    ]
+    for ops, score in chosen:
+        lines.append("SUPERINSTRUCTION%d(%s, %s) // %d" %
+                     (len(ops), name_of(ops), ", ".join(ops), score))
+    with open(path, "w") as out:
+        out.write("\n".join(lines) + "\n")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--clox", required=True,
+                        help="clox binary built with DEBUG_PROFILE_OPS")
+    parser.add_argument("--count", type=int, default=24,
+                        help="number of superinstructions to keep")
+    parser.add_argument("--cap", type=int, default=10000000,
+                        help="most instructions one script may count for")
+    parser.add_argument("--timeout", type=float, default=120,
+                        help="seconds to let each script run")
+    parser.add_argument("scripts", nargs="*",
+                        help="Lox scripts to profile (default: benchmarks "
+                             "and tests/interpreter)")
+    args = parser.parse_args()
+    if args.count > MAX_SUPERINSTRUCTIONS:
+        parser.error("at most %d superinstructions" % MAX_SUPERINSTRUCTIONS)
+
+    scripts = args.scripts or default_corpus()
+    scores = collections.Counter()
+    profiled = 0
+    for path in scripts:
+        result = profile(args.clox, path, args.timeout)
+        if result is None:
+            continue
+        executed, counts = result
+        profiled += 1
+        scale = min(1.0, args.cap / executed) if executed else 1.0
+        for ops, count in counts.items():
+            # Fusing n instructions saves n - 1 dispatches each time.
+            scores[ops] += count * scale * (len(ops) - 1)
+
+    chosen = scores.most_common(args.count)
+    for path in OUTPUTS:
+        write_header(path, chosen, profiled)
+    for ops, score in chosen:
+        print("%d %s" % (score, name_of(ops)))
+
+
+if __name__ == "__main__":
+    main()